@@ -5,14 +5,23 @@
  * @date 2023/09/23
  */
 
+#define _GNU_SOURCE /* dl_iterate_phdr */
 #include "gc.h"
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <link.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 /* ========================================================================== */
@@ -28,13 +37,19 @@
  *
  * @var Block_Header::flags
  * Flags indicating the state of the block. Use FL_ALLOC for allocated blocks
- * and FL_FREE for blocks that are in the free list.
+ * and FL_FREE for blocks that are in the free list; FL_PREV_FREE marks the
+ * block right after a free From-space block. The bits selected by
+ * FL_AGE_MASK count the collections the object has survived, and those above
+ * FL_SITE_SHIFT hold the allocation site.
  *
  * @var Block_Header::size
  * The size of the object, in bytes.
  *
  * @var Block_Header::next_free
- * A pointer to the next free object in the free list.
+ * A pointer to the next free object in the free list. During a collection it
+ * holds the forwarding pointer of a copied block. In an allocated From-space
+ * block it points to the block it was copied from by the last collection, or
+ * is NULL.
  */
 typedef struct block_header {
   size_t flags;
@@ -60,233 +75,6105 @@ typedef struct block_header {
  * @var Heap_Header::end
  * The end position of the heap. This marks the last byte that can be allocated
  * within the heap.
+ *
+ * @var Heap_Header::node
+ * The NUMA node the heap is bound to, or -1 if it is left to the kernel.
+ *
+ * @var Heap_Header::starts
+ * The object-start bitmap, one bit per word of the heap, set for every word
+ * holding a block header. It lives right after the end of the heap.
+ *
+ * @var Heap_Header::crossing
+ * The crossing map, one entry per card, the span of heap covered by a word
+ * of starts: how many cards back the header of the allocated block covering
+ * the first word of the card lies, or zero if unknown. It follows starts.
+ *
+ * @var Heap_Header::dirty
+ * For a write protected space, one bit per page written since the last
+ * collection or left writable by it, or NULL.
+ *
+ * @var Heap_Header::remembered
+ * The pages found holding pointers to To-space by the current collection.
  */
 typedef struct heap_header {
   size_t size;
   size_t current;
   size_t end;
+  int node;
+  size_t *starts;
+  size_t *crossing;
+  size_t *dirty;
+  size_t *remembered;
 } Heap_Header;
 
-Block_Header *free_list;
 Heap_Header *from_start;
 Heap_Header *to_start;
+Heap_Header *old_start;
+Heap_Header *perm_start;
+static Heap_Header *buddy_start;
+
+static void ***roots;
+static size_t roots_len;
+static size_t roots_cap;
+
+static size_t age_histogram[MINI_CPGC_AGE_MAX + 1];
+
+static bool type_histogram_enabled;
+static Mini_Cpgc_Type_Stats type_histogram[MINI_CPGC_MAX_SITES];
+static Mini_Cpgc_Type_Stats size_class_histogram[MINI_CPGC_SIZE_CLASSES];
+
+static FILE *leak_check_fp;
+static Mini_Cpgc_Type_Stats leaked[MINI_CPGC_MAX_SITES];
+static Mini_Cpgc_Type_Stats freed_reachable[MINI_CPGC_MAX_SITES];
+
+/**
+ * @struct Site_Stats
+ * @brief Survival statistics of an allocation site.
+ *
+ * @var Site_Stats::pending
+ * Objects allocated in From-space since the last collection.
+ *
+ * @var Site_Stats::tested
+ * Objects that have been through at least one collection.
+ *
+ * @var Site_Stats::survived
+ * Objects that survived their first collection.
+ *
+ * @var Site_Stats::pretenure
+ * Whether new objects of the site are allocated in the old space.
+ */
+typedef struct site_stats {
+  size_t pending;
+  size_t tested;
+  size_t survived;
+  bool pretenure;
+} Site_Stats;
+
+static Site_Stats sites[MINI_CPGC_MAX_SITES];
+static Block_Header *old_free;
+static Block_Header **ephemerons;
+static size_t ephemerons_len;
+static size_t ephemerons_cap;
+
+/**
+ * @struct Dedup_Entry
+ * @brief An entry of the string deduplication table.
+ *
+ * @var Dedup_Entry::hash
+ * The hash of the string body.
+ *
+ * @var Dedup_Entry::block
+ * The canonical copy of the string in To-space, or NULL for an empty slot.
+ */
+typedef struct dedup_entry {
+  size_t hash;
+  Block_Header *block;
+} Dedup_Entry;
+
+static size_t hash_pending;
+static size_t gc_epoch;
+static bool minor_collection;
+static bool pinning;
+
+/**
+ * @struct Map_Entry
+ * @brief A key/value pair of a Mini_Cpgc_Map, chained in its bucket.
+ */
+typedef struct map_entry {
+  void *key;
+  void *value;
+  struct map_entry *next;
+} Map_Entry;
+
+/**
+ * @struct Map_Table
+ * @brief A chained hash table keyed by object address.
+ *
+ * @var Map_Table::buckets
+ * The bucket heads, cap of them; cap is zero or a power of two.
+ *
+ * @var Map_Table::len
+ * The number of entries.
+ */
+typedef struct map_table {
+  Map_Entry **buckets;
+  size_t cap;
+  size_t len;
+} Map_Table;
+
+/**
+ * @struct mini_cpgc_map
+ * @brief A hash map keyed by object identity that survives collections.
+ *
+ * @var mini_cpgc_map::cur
+ * Entries hashed with the addresses of epoch.
+ *
+ * @var mini_cpgc_map::stale
+ * Entries hashed with the addresses of the epoch before, not yet migrated.
+ *
+ * @var mini_cpgc_map::epoch
+ * The collection count the map was last synchronized with.
+ *
+ * @var mini_cpgc_map::next
+ * The next map known to the collector.
+ */
+struct mini_cpgc_map {
+  Map_Table cur;
+  Map_Table stale;
+  size_t epoch;
+  struct mini_cpgc_map *next;
+};
+
+static Mini_Cpgc_Map *maps;
+
+static Heap_Header **frozen;
+static size_t frozen_len;
+
+/**
+ * @struct Data_Range
+ * @brief A writable segment of the executable or of a loaded library.
+ */
+typedef struct data_range {
+  void **start;
+  void **end;
+} Data_Range;
+
+static bool data_scan_enabled;
+static Data_Range *data_ranges;
+static size_t data_ranges_len;
+static unsigned long long data_adds;
+static unsigned long long data_subs;
+
+static bool dedup_enabled;
+static Dedup_Entry *dedup_table;
+static size_t dedup_len;
+static size_t dedup_cap;
+
+static pid_t mark_pid;
 
 #define TINY_HEAP_SIZE 0x4000
 #define PTRSIZE ((size_t)sizeof(void *))
 #define HEAP_HEADER_SIZE ((size_t)sizeof(Heap_Header))
 #define BLOCK_HEADER_SIZE ((size_t)sizeof(Block_Header))
 #define ALIGN(x, a) (((x) + (a - 1)) & ~(a - 1))
-#define NEXT_HEADER(x) ((Block_Header *)((size_t)(x + 1) + x->size))
+#define NEXT_HEADER(x) ((Block_Header *)((size_t)((x) + 1) + (x)->size))
+#define HEAP_USED(h) ((h)->current - (size_t)((h) + 1))
+#define HEAP_CAPACITY(h) ((h)->end - (size_t)((h) + 1))
+#define HEAP_FITS(h, s)                                                        \
+  ((h)->end - (h)->current >= BLOCK_HEADER_SIZE &&                             \
+   (s) <= (h)->end - (h)->current - BLOCK_HEADER_SIZE)
+#define IN_HEAP(h, p)                                                          \
+  ((size_t)(p) > (size_t)(h) && (size_t)(p) < (h)->current)
+#define OS_PAGE_SIZE ((size_t)sysconf(_SC_PAGESIZE))
+#define WORD_BITS (PTRSIZE * 8)
+#define START_MAP_SIZE(s) (ALIGN((s) / PTRSIZE, WORD_BITS) / 8)
+#define CROSSING_MAP_SIZE(s) START_MAP_SIZE(s)
+#define SPACE_MAP_SIZE(s)                                                      \
+  ALIGN(HEAP_HEADER_SIZE + (s) + START_MAP_SIZE(s) + CROSSING_MAP_SIZE(s),     \
+        OS_PAGE_SIZE)
 
 #define FL_ALLOC 0x1
 #define FL_FREE 0x0
-#define FL_TEST(x, f) (((Block_Header *)x)->flags & f)
+#define FL_COPIED 0x2
+#define FL_MARK 0x4
+#define FL_EPHEMERON 0x8
+#define FL_STRING 0x10
+#define FL_HASHED 0x20
+#define FL_HASH_SLOT 0x40
+#define FL_NOSCAN 0x80
+#define BODY_END(x)                                                            \
+  ((size_t)NEXT_HEADER(x) - (FL_TEST(x, FL_HASH_SLOT) ? PTRSIZE : 0))
+#define FL_AGE_SHIFT 8
+#define FL_AGE_MASK ((size_t)MINI_CPGC_AGE_MAX << FL_AGE_SHIFT)
+#define FL_AGE(x) ((((Block_Header *)x)->flags & FL_AGE_MASK) >> FL_AGE_SHIFT)
+#define FL_FREED 0x1000
+#define FL_PREV_FREE 0x2000
+#define FL_REPORTED 0x4000
+#define FL_QUEUED 0x8000
+#define FL_SITE_SHIFT 16
+#define FL_SITE(x) (((Block_Header *)x)->flags >> FL_SITE_SHIFT)
+#define FL_TEST(x, f) (((Block_Header *)(x))->flags & (f))
+
+static void collect(size_t req_size);
+static bool is_frozen(void *ptr);
+static void buddy_destroy(void);
+static void collect_young(size_t req_size);
+static void wp_remember(Block_Header *p);
+static void wp_release(Heap_Header *h);
+static bool compact_fault(size_t addr);
+static void compact_finish(void);
+static void mark_cancel(Mini_Cpgc_Heap *heap);
+
+/* ========================================================================== */
+/*  heap limit                                                                */
+/* ========================================================================== */
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP_HEAP_PERCENT 75
+#define LIMIT_SPACE_SIZE(l) (((l) / 2) & ~(PTRSIZE - 1))
+#define LIMIT_INIT_SIZE(l) (((l) / 4) & ~(PTRSIZE - 1))
+
+static const char *cgroup_dir;
+static size_t soft_limit;
 
 /**
- * @fn void heap_init(size_t req_size)
- * @brief Initializes the heap areas for From-space and To-space.
+ * @fn void mini_cpgc_set_cgroup_dir(const char *dir)
+ * @brief Overrides the cgroup v2 directory consulted by heap_init.
  *
- * Initializes two heap areas: From-space and To-space, both with the same size,
- * specified by the req_size parameter. If the given req_size is smaller than
- * TINY_HEAP_SIZE, then TINY_HEAP_SIZE is used as the size.
+ * By default the directory is derived from /proc/self/cgroup. Tests point it
+ * at a directory holding hand-written memory.max/memory.high files.
  *
- * @param req_size The requested size of the heap areas in bytes.
- * @return None
+ * @param dir The cgroup directory, or NULL to restore auto detection.
  */
-void heap_init(size_t req_size) {
-  void *p1, *p2;
+void mini_cpgc_set_cgroup_dir(const char *dir) { cgroup_dir = dir; }
 
-  if (req_size < TINY_HEAP_SIZE)
-    req_size = TINY_HEAP_SIZE;
+/**
+ * @fn void mini_cpgc_set_soft_limit(size_t bytes)
+ * @brief Sets the soft limit for the total size of both semispaces.
+ *
+ * A value of zero makes the next heap_init derive the limit from the cgroup.
+ *
+ * @param bytes The soft limit in bytes.
+ */
+void mini_cpgc_set_soft_limit(size_t bytes) { soft_limit = bytes; }
 
-  p1 = malloc(req_size + PTRSIZE + HEAP_HEADER_SIZE);
+/**
+ * @fn size_t mini_cpgc_soft_limit(void)
+ * @brief Returns the soft heap limit in bytes, or zero when unlimited.
+ */
+size_t mini_cpgc_soft_limit(void) { return soft_limit; }
 
-  from_start = (Heap_Header *)ALIGN((size_t)p1, PTRSIZE);
-  from_start->size = req_size;
-  from_start->current = (size_t)(from_start + 1);
-  from_start->end = (size_t)(from_start + 1 + req_size);
+/**
+ * @brief Reads a single cgroup memory control file.
+ *
+ * @param dir The cgroup directory.
+ * @param name The control file name, e.g. "memory.max".
+ * @return The limit in bytes, or zero if the file is missing or says "max".
+ */
+static size_t read_cgroup_value(const char *dir, const char *name) {
+  char path[PATH_MAX];
+  unsigned long long value;
+  FILE *fp;
 
-  p2 = malloc(req_size + PTRSIZE + HEAP_HEADER_SIZE);
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return 0;
+  if (fscanf(fp, "%llu", &value) != 1)
+    value = 0;
+  fclose(fp);
 
-  to_start = (Heap_Header *)ALIGN((size_t)p2, PTRSIZE);
-  to_start->size = req_size;
-  to_start->current = (size_t)(to_start + 1);
-  to_start->end = (size_t)(to_start + 1 + req_size);
+  return (size_t)value;
 }
 
 /**
- * @fn void *mini_cpgc_malloc(size_t req_size)
- * @brief Allocates memory in the From-space heap area.
+ * @brief Computes the soft heap limit from the cgroup memory controller.
  *
- * Allocates a memory block of size req_size in the From-space heap.
- * The function aligns the requested size to the nearest PTRSIZE boundary.
- * If the size is zero or negative, the function returns NULL.
+ * Takes the lower of memory.max and memory.high, and leaves
+ * (100 - CGROUP_HEAP_PERCENT)% of it to the rest of the process.
  *
- * @param req_size The requested size of the memory block in bytes.
- * @return A pointer to the allocated memory block, or NULL if the allocation
- * failed.
- * @warning The function does not check for heap overflow or perform garbage
- * collection.
+ * @return The soft limit in bytes, or zero if the cgroup has no limit.
  */
-void *mini_cpgc_malloc(size_t req_size) {
-  Block_Header *p, *prev;
+static size_t cgroup_soft_limit(void) {
+  char line[PATH_MAX], dir[PATH_MAX];
+  size_t max, high, limit;
+  FILE *fp;
 
-  req_size = ALIGN(req_size, PTRSIZE);
-  if (req_size <= 0) {
-    return NULL;
+  if (cgroup_dir != NULL) {
+    snprintf(dir, sizeof(dir), "%s", cgroup_dir);
+  } else {
+    /* cgroup v2 has a single "0::<path>" entry */
+    fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL)
+      return 0;
+    dir[0] = '\0';
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (strncmp(line, "0::", 3) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        /* a truncated path would name some other cgroup */
+        if (snprintf(dir, sizeof(dir), "%s%s", CGROUP_ROOT, line + 3) >=
+            (int)sizeof(dir))
+          dir[0] = '\0';
+        break;
+      }
+    }
+    fclose(fp);
+    if (dir[0] == '\0')
+      return 0;
   }
 
-  p = (Block_Header *)from_start->current;
-  p->size = req_size;
-  p->flags = FL_ALLOC;
-  from_start->current = from_start->current + req_size;
+  max = read_cgroup_value(dir, "memory.max");
+  high = read_cgroup_value(dir, "memory.high");
+  limit = max;
+  if (high != 0 && (limit == 0 || high < limit))
+    limit = high;
 
-  return (void *)(p + 1);
+  return limit / 100 * CGROUP_HEAP_PERCENT;
 }
 
 /**
- * @fn void mini_cpgc_free(void *ptr)
- * @brief Frees a memory block allocated by mini_cpgc_malloc.
+ * @brief Chooses the semispace size needed to hold need bytes.
  *
- * This function takes a pointer to a memory block previously allocated with
- * mini_cpgc_malloc and adds it back to the free list for potential future
- * reuse.
+ * Normally the semispace grows so that at least half of it stays free after a
+ * collection. As both semispaces approach what the old and permanent spaces
+ * leave of the soft limit it shrinks to that headroom instead, so collections
+ * become more frequent rather than the heap becoming bigger. The limit is soft:
+ * it never makes an allocation fail.
  *
- * @param ptr A pointer to the memory block to be freed.
+ * @param need The number of bytes that must fit in the semispace.
+ * @return The semispace size in bytes.
  */
-void mini_cpgc_free(void *ptr) {
-  Block_Header *target, *hit;
+static size_t space_target_size(size_t need) {
+  size_t size = HEAP_CAPACITY(from_start), limit;
 
-  target = (Block_Header *)ptr - 1;
+  while (size / 2 < need && size <= SIZE_MAX / 2)
+    size *= 2;
+  if (soft_limit != 0) {
+    limit = old_start->size + perm_start->size;
+    limit = soft_limit > limit ? soft_limit - limit : 0;
+    /* approaching the limit: collect more often */
+    if (size * 2 >= limit / 4 * 3)
+      size = need * 2;
+    if (size > LIMIT_SPACE_SIZE(limit))
+      size = LIMIT_SPACE_SIZE(limit);
+  }
+  if (size < need)
+    size = need;
+  if (size < TINY_HEAP_SIZE)
+    size = TINY_HEAP_SIZE;
 
-  if (free_list == NULL) {
-    free_list = target;
-    target->next_free = target;
-    target->flags = FL_FREE;
+  return ALIGN(size, PTRSIZE);
+}
 
-    return;
+/* ========================================================================== */
+/*  numa                                                                      */
+/* ========================================================================== */
+
+#define NUMA_NODE_DIR "/sys/devices/system/node"
+#define NUMA_MAX_NODES ((int)(sizeof(unsigned long) * 8))
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+static int numa_nodes;
+
+/**
+ * @brief Returns the number of NUMA nodes of the host, at least one.
+ */
+static int numa_node_count(void) {
+  char path[PATH_MAX];
+  int i;
+
+  if (numa_nodes != 0)
+    return numa_nodes;
+  for (i = 0; i < NUMA_MAX_NODES; i++) {
+    snprintf(path, sizeof(path), "%s/node%d", NUMA_NODE_DIR, i);
+    if (access(path, F_OK) == 0)
+      numa_nodes++;
   }
+  if (numa_nodes == 0)
+    numa_nodes = 1;
 
-  /* search join point of target to free_list */
-  for (hit = free_list; !(target > hit && target < hit->next_free);
-       hit = hit->next_free)
-    /* heap end? And hit(search)? */
-    if (hit >= hit->next_free && (target > hit || target < hit->next_free))
-      break;
+  return numa_nodes;
+}
 
-  if (NEXT_HEADER(target) == hit->next_free) {
-    /* merge */
-    target->size += (hit->next_free->size + BLOCK_HEADER_SIZE);
-    target->next_free = hit->next_free->next_free;
-  } else {
-    /* join next free block */
-    target->next_free = hit->next_free;
+/**
+ * @brief Returns the NUMA node of the CPU the calling thread runs on.
+ */
+static int numa_current_node(void) {
+  unsigned int cpu, node;
+
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+    return 0;
+
+  return (int)node;
+}
+
+/**
+ * @brief Prefers the given NUMA node for the pages of a semispace.
+ *
+ * Pages already touched are migrated. Nothing is done on single-node hosts or
+ * if the kernel refuses the policy, so the semispace keeps first-touch
+ * placement.
+ *
+ * @param h The semispace.
+ * @param node The NUMA node.
+ */
+static void numa_bind(Heap_Header *h, int node) {
+  unsigned long mask;
+
+  if (numa_node_count() < 2 || h->node == node || node >= NUMA_MAX_NODES)
+    return;
+
+  mask = 1UL << node;
+  if (syscall(SYS_mbind, h, SPACE_MAP_SIZE(h->size), NUMA_MPOL_PREFERRED,
+              &mask, (unsigned long)NUMA_MAX_NODES, NUMA_MPOL_MF_MOVE) == 0)
+    h->node = node;
+}
+
+/* ========================================================================== */
+/*  object start map                                                          */
+/* ========================================================================== */
+
+#define START_BIT(h, p) (((size_t)(p) - (size_t)((h) + 1)) / PTRSIZE)
+
+/**
+ * @brief Records that a block header starts at p.
+ *
+ * @param h The heap holding the block.
+ * @param p The block.
+ */
+static void start_set(Heap_Header *h, Block_Header *p) {
+  size_t i = START_BIT(h, p);
+
+  h->starts[i / WORD_BITS] |= (size_t)1 << (i % WORD_BITS);
+}
+
+/**
+ * @brief Records an allocated block and the cards its body covers.
+ *
+ * Called whenever a block is allocated, including blocks reused from free
+ * lists. Free blocks only get start_set, so the cards of free space may
+ * point at a header before the free block, which find_block rejects.
+ *
+ * @param h The heap holding the block.
+ * @param p The block.
+ * @param size The size of the block body in bytes.
+ */
+static void start_span(Heap_Header *h, Block_Header *p, size_t size) {
+  size_t card = START_BIT(h, p) / WORD_BITS, i, last;
+
+  start_set(h, p);
+  last = START_BIT(h, (size_t)(p + 1) + size - 1) / WORD_BITS;
+  for (i = card + 1; i <= last; i++)
+    h->crossing[i] = i - card;
+}
+
+/**
+ * @brief Forgets a block header that was merged into the block before it.
+ *
+ * @param h The heap holding the block.
+ * @param p The block.
+ */
+static void start_clear(Heap_Header *h, Block_Header *p) {
+  size_t i = START_BIT(h, p);
+
+  h->starts[i / WORD_BITS] &= ~((size_t)1 << (i % WORD_BITS));
+}
+
+/**
+ * @brief Finds the last block header at or before ptr.
+ *
+ * The card of ptr is searched first. If no header starts in it before ptr,
+ * the crossing map names the card holding the header of the block covering
+ * it, so lookups inside allocated blocks take constant time. Only when the
+ * entry is unknown or its card has been emptied by merges of free blocks is
+ * the bitmap searched backwards a word at a time.
+ *
+ * @param h The heap.
+ * @param ptr An address inside the heap.
+ * @return The block, or NULL if no block starts before ptr. Inside free
+ * space the block may end before ptr.
+ */
+static Block_Header *start_find(Heap_Header *h, void *ptr) {
+  size_t i = START_BIT(h, ptr), w = i / WORD_BITS, word;
+
+  word = h->starts[w] & (~(size_t)0 >> (WORD_BITS - 1 - i % WORD_BITS));
+  if (word == 0 && h->crossing[w] != 0 && h->crossing[w] <= w &&
+      h->starts[w - h->crossing[w]] != 0) {
+    w -= h->crossing[w];
+    word = h->starts[w];
   }
-  if (NEXT_HEADER(hit) == target) {
-    /* merge */
-    hit->size += (target->size + BLOCK_HEADER_SIZE);
-    hit->next_free = target->next_free;
-  } else {
-    /* join before free block */
-    hit->next_free = target;
+  while (word == 0) {
+    if (w == 0)
+      return NULL;
+    word = h->starts[--w];
   }
-  free_list = hit;
+  i = w * WORD_BITS + (WORD_BITS - 1 - (size_t)__builtin_clzl(word));
+
+  return (Block_Header *)((size_t)(h + 1) + i * PTRSIZE);
+}
+
+/**
+ * @brief Forgets every block header of a heap that is being emptied.
+ *
+ * @param h The heap.
+ */
+static void start_reset(Heap_Header *h) {
+  memset(h->starts, 0, START_MAP_SIZE(h->size));
 }
 
 /* ========================================================================== */
-/*  mini_cpgc                                                                 */
+/*  free lists                                                                */
 /* ========================================================================== */
 
+#define FREE_SL_LOG2 4
+#define FREE_SL_COUNT (1 << FREE_SL_LOG2)
+#define FREE_FL_COUNT WORD_BITS
+#define FREE_MIN_LINKED (2 * PTRSIZE)
+#define FREE_FOOTER(p) (((Block_Header **)NEXT_HEADER(p))[-1])
+#define FREE_PREV(p) (((Block_Header **)((Block_Header *)(p) + 1))[0])
+
+/*
+ * Freed From-space blocks, indexed two-level segregated fit (TLSF): the first
+ * level is the power of two of the size in words, the second splits it into
+ * FREE_SL_COUNT linear classes, and a bitmap per level tells which lists are
+ * non-empty. Sizes under FREE_SL_COUNT words get a class each. Lists are
+ * doubly linked through next_free and the first word of the body. A free
+ * block ends with a footer pointing to its header, and the block after it
+ * carries FL_PREV_FREE, so both neighbours are found without a search.
+ */
+static size_t free_fl_map;
+static size_t free_sl_map[FREE_FL_COUNT];
+static Block_Header *free_lists[FREE_FL_COUNT][FREE_SL_COUNT];
+
 /**
- * @brief Copy a block from the "from" heap to the "to" heap.
+ * @brief Returns the size class of a free block.
+ *
+ * @param size The body size, at least FREE_MIN_LINKED.
+ * @param fl The first level index.
+ * @param sl The second level index.
+ */
+static void free_class(size_t size, size_t *fl, size_t *sl) {
+  size_t words = size / PTRSIZE, log2;
+
+  if (words < FREE_SL_COUNT) {
+    *fl = 0;
+    *sl = words;
+    return;
+  }
+  log2 = WORD_BITS - 1 - (size_t)__builtin_clzl(words);
+  *fl = log2 - FREE_SL_LOG2 + 1;
+  *sl = (words >> (log2 - FREE_SL_LOG2)) - FREE_SL_COUNT;
+}
+
+/**
+ * @brief Turns a From-space block into a free block and lists it.
  *
- * This function copies a block, including its header, from the source heap
- * to the destination heap. The destination heap's free pointer is then
- * updated.
+ * Blocks with a one-word body are too small for both links; they only get a
+ * footer, and are absorbed when a neighbour is freed.
  *
- * @param from_block Pointer to the block in the "from" heap to be copied.
- * @param pfree Pointer to the current free space in the "to" heap.
- * @return Returns a pointer to the new block in the "to" heap.
+ * @param p The block, not allocated and not adjacent to another free block.
  */
-Block_Header *copy(Block_Header *from_block, void *pfree) {
-  Block_Header *to_block;
+static void free_link(Block_Header *p) {
+  Block_Header *next = NEXT_HEADER(p), **list;
+  size_t fl, sl;
 
-  to_block = memcpy(pfree, from_block, BLOCK_HEADER_SIZE + from_block->size);
-  pfree = (void *)(pfree + BLOCK_HEADER_SIZE + from_block->size);
+  p->flags = FL_FREE | (p->flags & FL_PREV_FREE);
+  FREE_FOOTER(p) = p;
+  if ((size_t)next < from_start->current)
+    next->flags |= FL_PREV_FREE;
+  if (p->size < FREE_MIN_LINKED)
+    return;
 
-  return to_block;
+  free_class(p->size, &fl, &sl);
+  list = &free_lists[fl][sl];
+  p->next_free = *list;
+  FREE_PREV(p) = NULL;
+  if (*list != NULL)
+    FREE_PREV(*list) = p;
+  *list = p;
+  free_fl_map |= (size_t)1 << fl;
+  free_sl_map[fl] |= (size_t)1 << sl;
 }
 
 /**
- * @brief Swap the "from" and "to" heaps.
+ * @brief Takes a free block off its list.
  *
- * This function swaps the pointers for the "from" and "to" heaps,
- * effectively making the "to" heap the new "from" heap for the next
- * garbage collection cycle.
+ * @param p The free block.
  */
-void swap() {
-  Heap_Header *tmp;
+static void free_unlink(Block_Header *p) {
+  Block_Header *next = NEXT_HEADER(p);
+  size_t fl, sl;
 
-  tmp = from_start;
-  from_start = to_start;
-  to_start = tmp;
+  if ((size_t)next < from_start->current)
+    next->flags &= ~(size_t)FL_PREV_FREE;
+  if (p->size < FREE_MIN_LINKED)
+    return;
 
-  free_list = NULL;
+  if (p->next_free != NULL)
+    FREE_PREV(p->next_free) = FREE_PREV(p);
+  if (FREE_PREV(p) != NULL) {
+    FREE_PREV(p)->next_free = p->next_free;
+    return;
+  }
+  free_class(p->size, &fl, &sl);
+  free_lists[fl][sl] = p->next_free;
+  if (p->next_free == NULL) {
+    free_sl_map[fl] &= ~((size_t)1 << sl);
+    if (free_sl_map[fl] == 0)
+      free_fl_map &= ~((size_t)1 << fl);
+  }
 }
 
 /**
- * @brief Perform the copying garbage collection.
+ * @brief Tells whether a From-space block is on the free lists.
+ */
+static bool free_listed(Block_Header *p) {
+  return (size_t)p < from_start->current && !FL_TEST(p, FL_ALLOC | FL_FREED);
+}
+
+/**
+ * @brief Finds a free block of at least a size in constant time.
+ *
+ * The size is rounded up to the next class boundary, so that any block of
+ * the first non-empty class at or above it fits. That class is found from
+ * the bitmaps with two bit scans.
  *
- * This function iterates over all the blocks in the "from" heap, copies
- * the allocated blocks to the "to" heap, and then swaps the heaps.
+ * @param size The body size.
+ * @return The block, still listed, or NULL if none is large enough.
  */
-void copying(void) {
-  Block_Header *p;
-  void *pfree = (void *)to_start + 1;
+static Block_Header *free_find(size_t size) {
+  size_t words = size / PTRSIZE, log2, fl, sl, map;
 
-  for (p = (Block_Header *)from_start + 1; (size_t)p < (size_t)from_start->end;
-       p = NEXT_HEADER(p)) {
-    if (p->flags == FL_ALLOC) {
-      copy(p, pfree);
-    }
+  if (words < FREE_MIN_LINKED / PTRSIZE)
+    words = FREE_MIN_LINKED / PTRSIZE;
+  if (words >= FREE_SL_COUNT) {
+    log2 = WORD_BITS - 1 - (size_t)__builtin_clzl(words);
+    words += ((size_t)1 << (log2 - FREE_SL_LOG2)) - 1;
   }
+  free_class(words * PTRSIZE, &fl, &sl);
 
-  swap();
+  map = free_sl_map[fl] & (~(size_t)0 << sl);
+  if (map == 0) {
+    map = fl + 1 < FREE_FL_COUNT ? free_fl_map & (~(size_t)0 << (fl + 1)) : 0;
+    if (map == 0)
+      return NULL;
+    fl = (size_t)__builtin_ctzl(map);
+    map = free_sl_map[fl];
+  }
+
+  return free_lists[fl][__builtin_ctzl(map)];
+}
+
+/**
+ * @brief Allocates a From-space block from the free lists.
+ *
+ * The block comes from free_find, and its rest is freed again when it can
+ * hold another block, so allocation takes bounded time.
+ *
+ * @param req_size The aligned size of the block body in bytes.
+ * @return The block, or NULL if no free block is large enough.
+ */
+static Block_Header *free_take(size_t req_size) {
+  Block_Header *p, *rest;
+
+  p = free_find(req_size);
+  if (p == NULL)
+    return NULL;
+
+  free_unlink(p);
+  if (p->size - req_size >= BLOCK_HEADER_SIZE + PTRSIZE) {
+    rest = (Block_Header *)((size_t)(p + 1) + req_size);
+    rest->flags = FL_FREE;
+    rest->size = p->size - req_size - BLOCK_HEADER_SIZE;
+    p->size = req_size;
+    start_set(from_start, rest);
+    free_link(rest);
+  }
+
+  return p;
+}
+
+/**
+ * @brief Empties the free lists, once From-space has been evacuated.
+ */
+static void free_reset(void) {
+  free_fl_map = 0;
+  memset(free_sl_map, 0, sizeof(free_sl_map));
+  memset(free_lists, 0, sizeof(free_lists));
 }
 
 /* ========================================================================== */
-/*  test                                                                      */
+/*  heap_init                                                                 */
 /* ========================================================================== */
 
-static void test_mini_cpgc_malloc_free(void) {
-  void *p;
+/**
+ * @brief Allocates an empty semispace.
+ *
+ * The semispace is mapped directly so that it is page aligned and can be
+ * bound to a NUMA node. It is placed on the node of the calling thread. The
+ * object-start bitmap and the crossing map are mapped along with it.
+ *
+ * @param size The usable size of the semispace in bytes.
+ * @return The new semispace, or NULL if the allocation failed.
+ */
+static Heap_Header *space_alloc(size_t size) {
+  Heap_Header *h;
 
-  /* malloc check */
-  unsigned int alloc_size = 9;
-  p = mini_cpgc_malloc(alloc_size);
-  assert((size_t)(from_start + 1) ==
-         (size_t)(from_start->current - ALIGN(alloc_size, PTRSIZE)));
+  h = mmap(NULL, SPACE_MAP_SIZE(size), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (h == MAP_FAILED)
+    return NULL;
+  h->size = size;
+  h->current = (size_t)(h + 1);
+  h->end = (size_t)(h + 1) + size;
+  h->node = -1;
+  h->starts = (size_t *)((size_t)(h + 1) + size);
+  h->crossing = (size_t *)((size_t)h->starts + START_MAP_SIZE(size));
+  numa_bind(h, numa_current_node());
 
-  /* free check */
-  mini_cpgc_free(p);
-  assert((Block_Header *)p - 1 == free_list);
+  return h;
 }
 
-static void test_garbage_collect(void) {
-  void *p1, *p2;
-  p1 = mini_cpgc_malloc(100);
-  p2 = mini_cpgc_malloc(100);
-  assert(FL_TEST(((Block_Header *)p1 - 1), FL_ALLOC));
-  assert(FL_TEST(((Block_Header *)p2 - 1), FL_ALLOC));
+/**
+ * @brief Releases a semispace allocated by space_alloc.
+ *
+ * @param h The semispace, or NULL.
+ */
+static void space_free(Heap_Header *h) {
+  if (h == NULL)
+    return;
+  wp_release(h);
+  munmap(h, SPACE_MAP_SIZE(h->size));
+}
 
-  mini_cpgc_free(p1);
-  copying();
-  assert(FL_TEST((Block_Header *)((from_start + 1) - 1), FL_ALLOC));
+/**
+ * @brief Replaces an empty semispace with one of a different size.
+ *
+ * The old semispace is kept if the new one cannot be allocated.
+ *
+ * @param space The semispace to replace.
+ * @param size The new usable size in bytes.
+ */
+static void space_resize(Heap_Header **space, size_t size) {
+  Heap_Header *h;
+
+  h = space_alloc(size);
+  if (h == NULL)
+    return;
+  space_free(*space);
+  *space = h;
+}
+
+/**
+ * @fn void heap_init(size_t req_size)
+ * @brief Initializes the heap areas for From-space, To-space, old space and
+ * permanent space.
+ *
+ * Initializes four heap areas: From-space, To-space, the non-moving old space
+ * for pretenured objects and the permanent space, all with the same size,
+ * specified by the req_size parameter. If the given req_size is smaller than
+ * TINY_HEAP_SIZE, then TINY_HEAP_SIZE is used as the size. Unless a soft limit
+ * was set explicitly, it is taken from the cgroup memory controller, and
+ * req_size is clamped so that all four spaces fit within it. Allocation site
+ * statistics start over, the buddy space, if any, is released, and a running
+ * concurrent mark is discarded.
+ *
+ * @param req_size The requested size of the heap areas in bytes.
+ * @return None
+ */
+void heap_init(size_t req_size) {
+  if (soft_limit == 0)
+    soft_limit = cgroup_soft_limit();
+  if (soft_limit != 0 && req_size > LIMIT_INIT_SIZE(soft_limit))
+    req_size = LIMIT_INIT_SIZE(soft_limit);
+  if (req_size < TINY_HEAP_SIZE)
+    req_size = TINY_HEAP_SIZE;
+  req_size = ALIGN(req_size, PTRSIZE);
+
+  compact_finish();
+  mark_cancel(mini_cpgc_heap_current());
+  space_free(from_start);
+  space_free(to_start);
+  space_free(old_start);
+  space_free(perm_start);
+  while (frozen_len > 0)
+    space_free(frozen[--frozen_len]);
+  buddy_destroy();
+  from_start = space_alloc(req_size);
+  to_start = space_alloc(req_size);
+  old_start = space_alloc(req_size);
+  perm_start = space_alloc(req_size);
+  free_reset();
+  old_free = NULL;
+  memset(sites, 0, sizeof(sites));
+}
+
+/* ========================================================================== */
+/*  buddy space                                                               */
+/* ========================================================================== */
+
+#define BUDDY_MIN_BLOCK (4 * PTRSIZE)
+#define BUDDY_BLOCK(k) (BUDDY_MIN_BLOCK << (k))
+#define BUDDY_OFFSET(p) ((size_t)(p) - (size_t)(buddy_start + 1))
+#define BUDDY_INDEX(p, k) (BUDDY_OFFSET(p) / BUDDY_BLOCK(k))
+
+/*
+ * Free blocks of order k are BUDDY_BLOCK(k) bytes, headers included, doubly
+ * linked on buddy_lists[k] and flagged in the bitmap buddy_maps[k], one bit
+ * per block of that order.
+ */
+static size_t buddy_orders;
+static Block_Header *buddy_lists[WORD_BITS];
+static size_t *buddy_maps[WORD_BITS];
+
+/**
+ * @brief Returns the smallest order whose blocks hold size bytes.
+ */
+static size_t buddy_order(size_t size) {
+  size_t k = 0;
+
+  while (BUDDY_BLOCK(k) < size)
+    k++;
+
+  return k;
+}
+
+/**
+ * @brief Tells whether a block is free at an order.
+ */
+static bool buddy_is_free(Block_Header *p, size_t k) {
+  size_t i = BUDDY_INDEX(p, k);
+
+  return buddy_maps[k][i / WORD_BITS] >> (i % WORD_BITS) & 1;
+}
+
+/**
+ * @brief Lists a free block of order k.
+ */
+static void buddy_push(Block_Header *p, size_t k) {
+  size_t i = BUDDY_INDEX(p, k);
+
+  p->flags = FL_FREE;
+  p->size = BUDDY_BLOCK(k) - BLOCK_HEADER_SIZE;
+  p->next_free = buddy_lists[k];
+  FREE_PREV(p) = NULL;
+  if (buddy_lists[k] != NULL)
+    FREE_PREV(buddy_lists[k]) = p;
+  buddy_lists[k] = p;
+  buddy_maps[k][i / WORD_BITS] |= (size_t)1 << (i % WORD_BITS);
+}
+
+/**
+ * @brief Takes a free block of order k off its list.
+ */
+static void buddy_remove(Block_Header *p, size_t k) {
+  size_t i = BUDDY_INDEX(p, k);
+
+  if (FREE_PREV(p) != NULL)
+    FREE_PREV(p)->next_free = p->next_free;
+  else
+    buddy_lists[k] = p->next_free;
+  if (p->next_free != NULL)
+    FREE_PREV(p->next_free) = FREE_PREV(p);
+  buddy_maps[k][i / WORD_BITS] &= ~((size_t)1 << (i % WORD_BITS));
+}
+
+/**
+ * @brief Allocates a block of an order, splitting a larger one if needed.
+ *
+ * @param order The order of the block.
+ * @return The block, or NULL if no free block is large enough.
+ */
+static Block_Header *buddy_take(size_t order) {
+  Block_Header *p, *half;
+  size_t k;
+
+  for (k = order; k < buddy_orders && buddy_lists[k] == NULL; k++)
+    ;
+  if (k == buddy_orders)
+    return NULL;
+
+  p = buddy_lists[k];
+  buddy_remove(p, k);
+  while (k > order) {
+    k--;
+    half = (Block_Header *)((size_t)p + BUDDY_BLOCK(k));
+    start_set(buddy_start, half);
+    buddy_push(half, k);
+  }
+  p->size = BUDDY_BLOCK(order) - BLOCK_HEADER_SIZE;
+
+  return p;
+}
+
+/**
+ * @brief Frees a block, merging it with its buddy as long as that is free.
+ *
+ * The buddy of a block of order k lies at its offset XOR BUDDY_BLOCK(k).
+ *
+ * @param p The block.
+ */
+static void buddy_release(Block_Header *p) {
+  Block_Header *buddy;
+  size_t k;
+
+  for (k = buddy_order(BLOCK_HEADER_SIZE + p->size); k + 1 < buddy_orders;
+       k++) {
+    buddy = (Block_Header *)((size_t)(buddy_start + 1) +
+                             (BUDDY_OFFSET(p) ^ BUDDY_BLOCK(k)));
+    if (!buddy_is_free(buddy, k))
+      break;
+    buddy_remove(buddy, k);
+    if (buddy < p) {
+      start_clear(buddy_start, p);
+      p = buddy;
+    } else {
+      start_clear(buddy_start, buddy);
+    }
+  }
+  buddy_push(p, k);
+}
+
+/**
+ * @brief Releases the buddy space and its bitmaps.
+ */
+static void buddy_destroy(void) {
+  size_t k;
+
+  space_free(buddy_start);
+  buddy_start = NULL;
+  for (k = 0; k < buddy_orders; k++) {
+    free(buddy_maps[k]);
+    buddy_maps[k] = NULL;
+    buddy_lists[k] = NULL;
+  }
+  buddy_orders = 0;
+}
+
+/**
+ * @fn int mini_cpgc_buddy_init(size_t size)
+ * @brief Creates the buddy space, replacing any previous one.
+ *
+ * The buddy space serves mini_cpgc_malloc_buddy. Its objects never move;
+ * they are marked when reached and swept like the old space, and can also
+ * be freed explicitly.
+ *
+ * @param size The size of the space in bytes, rounded up to a power of two.
+ * @return Non-zero on success, zero if memory ran out.
+ */
+int mini_cpgc_buddy_init(size_t size) {
+  size_t k, bits;
+
+  buddy_destroy();
+  buddy_orders = buddy_order(size) + 1;
+  buddy_start = space_alloc(BUDDY_BLOCK(buddy_orders - 1));
+  for (k = 0; buddy_start != NULL && k < buddy_orders; k++) {
+    bits = (size_t)1 << (buddy_orders - 1 - k);
+    buddy_maps[k] = calloc(ALIGN(bits, WORD_BITS) / WORD_BITS, PTRSIZE);
+    if (buddy_maps[k] == NULL)
+      break;
+  }
+  if (buddy_start == NULL || k < buddy_orders) {
+    buddy_destroy();
+    return 0;
+  }
+
+  buddy_start->current = buddy_start->end;
+  start_set(buddy_start, (Block_Header *)(buddy_start + 1));
+  buddy_push((Block_Header *)(buddy_start + 1), buddy_orders - 1);
+
+  return 1;
+}
+
+/**
+ * @fn void *mini_cpgc_malloc_buddy(size_t req_size)
+ * @brief Allocates memory in the buddy space.
+ *
+ * The block, header included, is rounded up to a power of two, so that it is
+ * allocated and freed in O(log n) and wastes at most half of itself. A
+ * collection runs if no block is large enough.
+ *
+ * @param req_size The requested size of the memory block in bytes.
+ * @return A pointer to the allocated memory block, or NULL if the size is
+ * zero, there is no buddy space, or it is full.
+ */
+void *mini_cpgc_malloc_buddy(size_t req_size) {
+  Block_Header *p;
+  size_t k;
+
+  req_size = ALIGN(req_size, PTRSIZE);
+  if (req_size <= 0 || buddy_start == NULL)
+    return NULL;
+  k = buddy_order(BLOCK_HEADER_SIZE + req_size);
+  if (k >= buddy_orders)
+    return NULL;
+
+  p = buddy_take(k);
+  if (p == NULL) {
+    collect(0);
+    p = buddy_take(k);
+    if (p == NULL)
+      return NULL;
+  }
+  p->flags = FL_ALLOC;
+  start_span(buddy_start, p, p->size);
+
+  return (void *)(p + 1);
+}
+
+/**
+ * @brief Frees the buddy blocks that were not marked by the last trace.
+ *
+ * Marks are cleared for the next collection. A merge leaves the headers of
+ * the blocks it absorbs in place, so the walk stays on block boundaries.
+ */
+static void sweep_buddy(void) {
+  Block_Header *p, *next;
+
+  if (buddy_start == NULL)
+    return;
+  for (p = (Block_Header *)(buddy_start + 1);
+       (size_t)p < buddy_start->current; p = next) {
+    next = NEXT_HEADER(p);
+    if (FL_TEST(p, FL_MARK))
+      p->flags &= ~(size_t)FL_MARK;
+    else if (FL_TEST(p, FL_ALLOC | FL_FREED))
+      buddy_release(p);
+  }
+}
+
+/* ========================================================================== */
+/*  pretenuring                                                               */
+/* ========================================================================== */
+
+#define PRETENURE_MIN_SAMPLES 32
+#define PRETENURE_PERCENT 90
+
+/**
+ * @brief Allocates a block in the old space.
+ *
+ * Dead blocks collected by sweep_old are reused first fit, splitting off the
+ * rest when it can hold another block. Otherwise, and always while a
+ * concurrent mark runs, the block is bumped from the end of the old space.
+ *
+ * @param req_size The aligned size of the block body in bytes.
+ * @param flags The flags of the new block.
+ * @return A pointer to the block body, or NULL if the old space is full.
+ */
+static void *old_malloc(size_t req_size, size_t flags) {
+  Block_Header *p, *rest, **link;
+
+  for (link = &old_free; mark_pid == 0 && *link != NULL;
+       link = &(*link)->next_free) {
+    p = *link;
+    if (p->size < req_size)
+      continue;
+    if (p->size - req_size >= BLOCK_HEADER_SIZE + PTRSIZE) {
+      rest = (Block_Header *)((size_t)(p + 1) + req_size);
+      rest->flags = FL_FREE;
+      rest->size = p->size - req_size - BLOCK_HEADER_SIZE;
+      rest->next_free = p->next_free;
+      *link = rest;
+      p->size = req_size;
+      start_set(old_start, rest);
+    } else {
+      *link = p->next_free;
+    }
+    p->flags = flags;
+    start_span(old_start, p, p->size);
+    return (void *)(p + 1);
+  }
+
+  if (!HEAP_FITS(old_start, req_size))
+    return NULL;
+  p = (Block_Header *)old_start->current;
+  p->size = req_size;
+  p->flags = flags;
+  start_span(old_start, p, req_size);
+  old_start->current = old_start->current + BLOCK_HEADER_SIZE + req_size;
+
+  return (void *)(p + 1);
+}
+
+/**
+ * @brief Frees the old blocks that were not marked by the last trace.
+ *
+ * Runs of dead and freed blocks are merged and rebuild old_free in address
+ * order. Marks are cleared for the next collection.
+ */
+static void sweep_old(void) {
+  Block_Header *p, *next, *run = NULL, **link = &old_free;
+
+  for (p = (Block_Header *)(old_start + 1); (size_t)p < old_start->current;
+       p = next) {
+    next = NEXT_HEADER(p);
+    if (FL_TEST(p, FL_MARK)) {
+      p->flags &= ~(size_t)FL_MARK;
+      run = NULL;
+    } else if (run != NULL) {
+      run->size += BLOCK_HEADER_SIZE + p->size;
+      start_clear(old_start, p);
+    } else {
+      run = p;
+      run->flags = FL_FREE;
+      *link = run;
+      link = &run->next_free;
+    }
+  }
+  *link = NULL;
+}
+
+/**
+ * @brief Updates the survival rate of every allocation site.
+ *
+ * Called after each collection. Objects allocated in From-space since the
+ * previous collection have now been tested once; a site whose objects
+ * survive their first collection at least PRETENURE_PERCENT of the time,
+ * over PRETENURE_MIN_SAMPLES objects, is switched to the old space.
+ */
+static void site_update(void) {
+  Site_Stats *s;
+  size_t i;
+
+  for (i = 1; i < MINI_CPGC_MAX_SITES; i++) {
+    s = &sites[i];
+    s->tested += s->pending;
+    s->pending = 0;
+    if (s->tested >= PRETENURE_MIN_SAMPLES &&
+        s->survived * 100 >= s->tested * PRETENURE_PERCENT)
+      s->pretenure = true;
+  }
+}
+
+/**
+ * @fn int mini_cpgc_site_pretenured(unsigned int site)
+ * @brief Tells whether an allocation site allocates in the old space.
+ *
+ * @param site The allocation site id.
+ * @return Non-zero if the site is pretenured.
+ */
+int mini_cpgc_site_pretenured(unsigned int site) {
+  return site < MINI_CPGC_MAX_SITES && sites[site].pretenure;
+}
+
+/**
+ * @fn void *mini_cpgc_malloc(size_t req_size)
+ * @brief Allocates memory in the From-space heap area.
+ *
+ * Allocates a memory block of size req_size in the From-space heap.
+ * The function aligns the requested size to the nearest PTRSIZE boundary.
+ * If the size is zero or negative, the function returns NULL.
+ *
+ * @param req_size The requested size of the memory block in bytes.
+ * @return A pointer to the allocated memory block, or NULL if the allocation
+ * failed.
+ * @note If the From-space is full, a garbage collection is performed first,
+ * growing the heap if the live data still leaves too little room.
+ */
+void *mini_cpgc_malloc(size_t req_size) {
+  return mini_cpgc_malloc_site(req_size, MINI_CPGC_NO_SITE);
+}
+
+/**
+ * @fn void *mini_cpgc_malloc_site(size_t req_size, unsigned int site)
+ * @brief Allocates memory on behalf of an allocation site.
+ *
+ * Behaves like mini_cpgc_malloc, and records the object in the survival
+ * statistics of the site. Once the site is pretenured the object is placed
+ * in the old space instead, where it is never copied. Site ids outside
+ * MINI_CPGC_MAX_SITES are treated as MINI_CPGC_NO_SITE, which is never
+ * pretenured. Freed blocks are not reused while a concurrent mark runs, so
+ * that the blocks it reports dead are still the ones it saw.
+ *
+ * @param req_size The requested size of the memory block in bytes.
+ * @param site The allocation site id.
+ * @return A pointer to the allocated memory block, or NULL if the allocation
+ * failed.
+ */
+void *mini_cpgc_malloc_site(size_t req_size, unsigned int site) {
+  Block_Header *p;
+  void *ptr;
+
+  /* no space could ever hold it, and sizing one would overflow */
+  if (req_size > SIZE_MAX / 4)
+    return NULL;
+  req_size = ALIGN(req_size, PTRSIZE);
+  if (req_size <= 0) {
+    return NULL;
+  }
+  if (site >= MINI_CPGC_MAX_SITES)
+    site = MINI_CPGC_NO_SITE;
+
+  if (sites[site].pretenure) {
+    ptr = old_malloc(req_size, FL_ALLOC | (size_t)site << FL_SITE_SHIFT);
+    if (ptr != NULL)
+      return ptr;
+  }
+
+  p = mark_pid == 0 ? free_take(req_size) : NULL;
+  if (p != NULL) {
+    p->flags = FL_ALLOC | (size_t)site << FL_SITE_SHIFT |
+               (p->flags & FL_PREV_FREE);
+    p->next_free = NULL;
+    start_span(from_start, p, p->size);
+    sites[site].pending++;
+    return (void *)(p + 1);
+  }
+
+  if (!HEAP_FITS(from_start, req_size)) {
+    collect_young(req_size);
+    /* the first collection only resized To-space, evacuate into it */
+    if (!HEAP_FITS(from_start, req_size))
+      collect(req_size);
+    if (!HEAP_FITS(from_start, req_size))
+      return NULL;
+  }
+
+  p = (Block_Header *)from_start->current;
+  p->size = req_size;
+  p->flags = FL_ALLOC | (size_t)site << FL_SITE_SHIFT;
+  p->next_free = NULL;
+  start_span(from_start, p, req_size);
+  from_start->current = from_start->current + BLOCK_HEADER_SIZE + req_size;
+  sites[site].pending++;
+
+  return (void *)(p + 1);
+}
+
+/**
+ * @fn void *mini_cpgc_malloc_atomic(size_t req_size)
+ * @brief Allocates memory that never holds heap pointers.
+ *
+ * Behaves like mini_cpgc_malloc, but the block is never scanned, so integers
+ * in it that happen to look like object addresses neither keep objects alive
+ * nor get rewritten when those objects move.
+ *
+ * @param req_size The requested size of the memory block in bytes.
+ * @return A pointer to the allocated memory block, or NULL if the allocation
+ * failed.
+ */
+void *mini_cpgc_malloc_atomic(size_t req_size) {
+  void *ptr;
+
+  ptr = mini_cpgc_malloc(req_size);
+  if (ptr != NULL)
+    ((Block_Header *)ptr - 1)->flags |= FL_NOSCAN;
+
+  return ptr;
+}
+
+/**
+ * @fn void mini_cpgc_free(void *ptr)
+ * @brief Frees a memory block allocated by mini_cpgc_malloc.
+ *
+ * This function takes a pointer to a memory block previously allocated with
+ * mini_cpgc_malloc, merges it with its free neighbours in constant time, and
+ * adds it back to the free lists for reuse. Blocks in the old space are only
+ * flagged; the next sweep reclaims them. Blocks in the permanent and frozen
+ * spaces are never freed. During a leak check, blocks keep their size and site
+ * until the next collection.
+ *
+ * @param ptr A pointer to the memory block to be freed.
+ */
+void mini_cpgc_free(void *ptr) {
+  Block_Header *target, *next, *prev;
+
+  target = (Block_Header *)ptr - 1;
+
+  if (IN_HEAP(perm_start, target) || is_frozen(target))
+    return;
+
+  if (leak_check_fp != NULL) {
+    target->flags = FL_FREED | (size_t)FL_SITE(target) << FL_SITE_SHIFT;
+    return;
+  }
+
+  if (IN_HEAP(old_start, target)) {
+    target->flags = FL_FREE;
+    return;
+  }
+  if (buddy_start != NULL && IN_HEAP(buddy_start, target)) {
+    buddy_release(target);
+    return;
+  }
+
+  /* merge with the physical neighbours through the boundary tags */
+  next = NEXT_HEADER(target);
+  if (free_listed(next)) {
+    free_unlink(next);
+    start_clear(from_start, next);
+    target->size += BLOCK_HEADER_SIZE + next->size;
+  }
+  if (FL_TEST(target, FL_PREV_FREE)) {
+    prev = ((Block_Header **)target)[-1];
+    free_unlink(prev);
+    start_clear(from_start, target);
+    prev->size += BLOCK_HEADER_SIZE + target->size;
+    target = prev;
+  }
+  free_link(target);
+}
+
+/* ========================================================================== */
+/*  permanent space                                                           */
+/* ========================================================================== */
+
+/**
+ * @fn void *mini_cpgc_malloc_permanent(size_t req_size, int pointer_free)
+ * @brief Allocates memory that lives until the heap is destroyed.
+ *
+ * The block is placed in the permanent space, which is never evacuated nor
+ * swept. Every collection scans its blocks for pointers into the other
+ * spaces, skipping those declared pointer free without reading their bodies.
+ *
+ * @param req_size The requested size of the memory block in bytes.
+ * @param pointer_free Non-zero if the block never holds heap pointers.
+ * @return A pointer to the allocated memory block, or NULL if the size is zero
+ * or the permanent space is full.
+ */
+void *mini_cpgc_malloc_permanent(size_t req_size, int pointer_free) {
+  Block_Header *p;
+
+  req_size = ALIGN(req_size, PTRSIZE);
+  if (req_size <= 0 || !HEAP_FITS(perm_start, req_size))
+    return NULL;
+
+  p = (Block_Header *)perm_start->current;
+  p->size = req_size;
+  p->flags = FL_ALLOC | (pointer_free ? FL_NOSCAN : 0);
+  start_span(perm_start, p, req_size);
+  perm_start->current = perm_start->current + BLOCK_HEADER_SIZE + req_size;
+
+  return (void *)(p + 1);
+}
+
+/* ========================================================================== */
+/*  identity hash                                                             */
+/* ========================================================================== */
+
+/**
+ * @brief Hashes the address of an object body.
+ *
+ * @param ptr The object body.
+ * @return The hash.
+ */
+static size_t address_hash(void *ptr) {
+  size_t h = (size_t)ptr * (size_t)0x9e3779b97f4a7c15ULL;
+
+  return h ^ (h >> 32);
+}
+
+/**
+ * @fn size_t mini_cpgc_identity_hash(void *ptr)
+ * @brief Returns a hash code that stays the same when the object moves.
+ *
+ * The first call derives the hash from the current address and flags the
+ * object, unless it can never move. When copy() moves a flagged object, it
+ * appends a hash slot to the copy and stores the hash there, so the address is
+ * only hashed once.
+ *
+ * @param ptr A pointer to an allocated object.
+ * @return The identity hash of the object.
+ */
+size_t mini_cpgc_identity_hash(void *ptr) {
+  Block_Header *p = (Block_Header *)ptr - 1;
+
+  if (FL_TEST(p, FL_HASH_SLOT))
+    return *(size_t *)BODY_END(p);
+  /* permanent and frozen objects never move */
+  if (!FL_TEST(p, FL_HASHED) &&
+      (IN_HEAP(from_start, p) || IN_HEAP(old_start, p))) {
+    p->flags |= FL_HASHED;
+    /* the next evacuation needs room for its slot */
+    if (IN_HEAP(from_start, p))
+      hash_pending++;
+  }
+
+  return address_hash(ptr);
+}
+
+/* ========================================================================== */
+/*  type histogram                                                            */
+/* ========================================================================== */
+
+/**
+ * @fn void mini_cpgc_set_type_histogram(int enable)
+ * @brief Enables or disables the per-type histogram of survivors.
+ *
+ * Objects are typed by the site id given to mini_cpgc_malloc_site. Objects
+ * without one are counted by the size class of their body instead.
+ *
+ * @param enable Non-zero to count the survivors of each collection.
+ */
+void mini_cpgc_set_type_histogram(int enable) {
+  type_histogram_enabled = enable != 0;
+}
+
+/**
+ * @brief Counts a surviving block in the type histogram.
+ *
+ * @param p The block.
+ */
+static void type_histogram_add(Block_Header *p) {
+  Mini_Cpgc_Type_Stats *s;
+
+  if (FL_SITE(p) != MINI_CPGC_NO_SITE)
+    s = &type_histogram[FL_SITE(p)];
+  else if (p->size == 0)
+    s = &size_class_histogram[0];
+  else
+    s = &size_class_histogram[WORD_BITS - (size_t)__builtin_clzl(p->size)];
+  s->count++;
+  s->bytes += BLOCK_HEADER_SIZE + p->size;
+}
+
+/**
+ * @fn const Mini_Cpgc_Type_Stats *mini_cpgc_type_histogram(void)
+ * @brief Returns the survivors of the last collection by type.
+ *
+ * @return An array of MINI_CPGC_MAX_SITES entries indexed by site id.
+ */
+const Mini_Cpgc_Type_Stats *mini_cpgc_type_histogram(void) {
+  return type_histogram;
+}
+
+/**
+ * @fn const Mini_Cpgc_Type_Stats *mini_cpgc_size_class_histogram(void)
+ * @brief Returns the untyped survivors of the last collection by size.
+ *
+ * Entry k > 0 counts the bodies whose size is in [2^(k-1), 2^k), entry 0
+ * the empty ones.
+ *
+ * @return An array of MINI_CPGC_SIZE_CLASSES entries.
+ */
+const Mini_Cpgc_Type_Stats *mini_cpgc_size_class_histogram(void) {
+  return size_class_histogram;
+}
+
+/**
+ * @struct Type_Row
+ * @brief A line of the text dump of the type histogram.
+ */
+typedef struct type_row {
+  bool typed;
+  size_t index;
+  const Mini_Cpgc_Type_Stats *stats;
+} Type_Row;
+
+/**
+ * @brief qsort comparator putting the biggest types first.
+ */
+static int type_row_cmp(const void *a, const void *b) {
+  size_t x = ((const Type_Row *)a)->stats->bytes;
+  size_t y = ((const Type_Row *)b)->stats->bytes;
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * @fn void mini_cpgc_dump_type_histogram(FILE *fp)
+ * @brief Prints the type histogram, biggest types first.
+ *
+ * @param fp The stream to print to.
+ */
+void mini_cpgc_dump_type_histogram(FILE *fp) {
+  Type_Row rows[MINI_CPGC_MAX_SITES + MINI_CPGC_SIZE_CLASSES];
+  size_t i, n = 0, count = 0, bytes = 0;
+
+  for (i = 0; i < MINI_CPGC_MAX_SITES; i++)
+    if (type_histogram[i].count != 0)
+      rows[n++] = (Type_Row){true, i, &type_histogram[i]};
+  for (i = 0; i < MINI_CPGC_SIZE_CLASSES; i++)
+    if (size_class_histogram[i].count != 0)
+      rows[n++] = (Type_Row){false, i, &size_class_histogram[i]};
+  qsort(rows, n, sizeof(*rows), type_row_cmp);
+
+  fprintf(fp, "%-24s %12s %12s\n", "type", "count", "bytes");
+  for (i = 0; i < n; i++) {
+    if (rows[i].typed)
+      fprintf(fp, "site %-19zu", rows[i].index);
+    else if (rows[i].index == 0)
+      fprintf(fp, "size %-19d", 0);
+    else
+      fprintf(fp, "size %-8zu- %-9zu", (size_t)1 << (rows[i].index - 1),
+              ((size_t)1 << rows[i].index) - 1);
+    fprintf(fp, " %12zu %12zu\n", rows[i].stats->count, rows[i].stats->bytes);
+    count += rows[i].stats->count;
+    bytes += rows[i].stats->bytes;
+  }
+  fprintf(fp, "%-24s %12zu %12zu\n", "total", count, bytes);
+}
+
+/* ========================================================================== */
+/*  leak check                                                                */
+/* ========================================================================== */
+
+/**
+ * @fn void mini_cpgc_set_leak_check(FILE *fp)
+ * @brief Enables or disables the leak check.
+ *
+ * While enabled, mini_cpgc_free only quarantines blocks until the next
+ * collection, and each collection reports to fp the blocks that became
+ * unreachable without being freed and the freed blocks that were still
+ * referenced, both by allocation site. Pointers are found conservatively, so
+ * a stale word holding the address of a freed block is reported too.
+ *
+ * @param fp The stream to report to, or NULL to disable the check.
+ */
+void mini_cpgc_set_leak_check(FILE *fp) { leak_check_fp = fp; }
+
+/**
+ * @fn const Mini_Cpgc_Type_Stats *mini_cpgc_leaked(void)
+ * @brief Returns the blocks the last collection found dead but not freed.
+ *
+ * @return An array of MINI_CPGC_MAX_SITES entries indexed by site id.
+ */
+const Mini_Cpgc_Type_Stats *mini_cpgc_leaked(void) { return leaked; }
+
+/**
+ * @fn const Mini_Cpgc_Type_Stats *mini_cpgc_freed_reachable(void)
+ * @brief Returns the freed blocks the last collection found still referenced.
+ *
+ * @return An array of MINI_CPGC_MAX_SITES entries indexed by site id.
+ */
+const Mini_Cpgc_Type_Stats *mini_cpgc_freed_reachable(void) {
+  return freed_reachable;
+}
+
+/**
+ * @brief Counts a block in a leak check table.
+ */
+static void leak_count(Mini_Cpgc_Type_Stats *table, Block_Header *p) {
+  table[FL_SITE(p)].count++;
+  table[FL_SITE(p)].bytes += BLOCK_HEADER_SIZE + p->size;
+}
+
+/**
+ * @brief Counts a reference to a quarantined block, once per collection.
+ *
+ * @param ptr A candidate pointer that matched no allocated block.
+ */
+static void leak_check_freed(void *ptr) {
+  Block_Header *p = NULL;
+
+  if ((size_t)ptr > (size_t)(from_start + 1) &&
+      (size_t)ptr < from_start->current)
+    p = start_find(from_start, ptr);
+  else if ((size_t)ptr > (size_t)(old_start + 1) &&
+           (size_t)ptr < old_start->current)
+    p = start_find(old_start, ptr);
+  else if (buddy_start != NULL && (size_t)ptr > (size_t)(buddy_start + 1) &&
+           (size_t)ptr < buddy_start->current)
+    p = start_find(buddy_start, ptr);
+  if (p == NULL || (size_t)ptr < (size_t)(p + 1) ||
+      (size_t)ptr >= (size_t)NEXT_HEADER(p) ||
+      FL_TEST(p, FL_FREED | FL_REPORTED) != FL_FREED)
+    return;
+
+  p->flags |= FL_REPORTED;
+  leak_count(freed_reachable, p);
+}
+
+/**
+ * @brief Counts the blocks the trace left behind without them being freed.
+ *
+ * Runs after the trace, before the old space is swept.
+ */
+static void leak_check_dead(void) {
+  Block_Header *p;
+
+  for (p = (Block_Header *)(from_start + 1); (size_t)p < from_start->current;
+       p = NEXT_HEADER(p))
+    if (FL_TEST(p, FL_ALLOC | FL_COPIED | FL_MARK) == FL_ALLOC)
+      leak_count(leaked, p);
+  for (p = (Block_Header *)(old_start + 1); (size_t)p < old_start->current;
+       p = NEXT_HEADER(p))
+    if (FL_TEST(p, FL_ALLOC | FL_COPIED | FL_MARK) == FL_ALLOC)
+      leak_count(leaked, p);
+  if (buddy_start == NULL)
+    return;
+  for (p = (Block_Header *)(buddy_start + 1); (size_t)p < buddy_start->current;
+       p = NEXT_HEADER(p))
+    if (FL_TEST(p, FL_ALLOC | FL_COPIED | FL_MARK) == FL_ALLOC)
+      leak_count(leaked, p);
+}
+
+/**
+ * @brief Prints the findings of the leak check of the last collection.
+ */
+static void leak_check_report(void) {
+  size_t i;
+
+  for (i = 0; i < MINI_CPGC_MAX_SITES; i++) {
+    if (leaked[i].count != 0)
+      fprintf(leak_check_fp,
+              "mini_cpgc: site %zu: %zu blocks (%zu bytes) unreachable but "
+              "never freed\n",
+              i, leaked[i].count, leaked[i].bytes);
+    if (freed_reachable[i].count != 0)
+      fprintf(leak_check_fp,
+              "mini_cpgc: site %zu: %zu blocks (%zu bytes) freed but still "
+              "reachable\n",
+              i, freed_reachable[i].count, freed_reachable[i].bytes);
+  }
+}
+
+/* ========================================================================== */
+/*  mini_cpgc                                                                 */
+/* ========================================================================== */
+
+/**
+ * @fn void mini_cpgc_add_root(void **root)
+ * @brief Registers a variable holding a heap pointer as a root.
+ *
+ * The variable is updated whenever the object it points to is moved.
+ *
+ * @param root The address of the root variable.
+ */
+void mini_cpgc_add_root(void **root) {
+  void ***p;
+
+  if (roots_len == roots_cap) {
+    roots_cap = roots_cap == 0 ? 16 : roots_cap * 2;
+    p = realloc(roots, roots_cap * sizeof(*roots));
+    if (p == NULL) {
+      perror("mini_cpgc_add_root");
+      exit(EXIT_FAILURE);
+    }
+    roots = p;
+  }
+  roots[roots_len++] = root;
+}
+
+/**
+ * @fn void mini_cpgc_remove_root(void **root)
+ * @brief Unregisters a root added by mini_cpgc_add_root.
+ *
+ * @param root The address of the root variable.
+ */
+void mini_cpgc_remove_root(void **root) {
+  size_t i;
+
+  for (i = 0; i < roots_len; i++) {
+    if (roots[i] == root) {
+      roots[i] = roots[--roots_len];
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Copies a block to the end of a space, leaving the source as it is.
+ *
+ * The block is copied with its header. The first time an object with an
+ * identity hash is moved, a slot holding the hash is appended to the copy.
+ * The copy remembers the source block in next_free.
+ *
+ * @param from_block The block to copy.
+ * @param to The space to copy it to, with room for it.
+ * @return The copy.
+ */
+static Block_Header *duplicate(Block_Header *from_block, Heap_Header *to) {
+  Block_Header *to_block;
+
+  to_block = memcpy((void *)to->current, from_block,
+                    BLOCK_HEADER_SIZE + from_block->size);
+  if (FL_TEST(from_block, FL_HASHED) && !FL_TEST(from_block, FL_HASH_SLOT)) {
+    *(size_t *)NEXT_HEADER(to_block) = address_hash(from_block + 1);
+    to_block->size += PTRSIZE;
+    to_block->flags |= FL_HASH_SLOT;
+  }
+  to->current = (size_t)NEXT_HEADER(to_block);
+  to_block->flags &= ~(size_t)FL_PREV_FREE;
+  to_block->next_free = from_block;
+  start_span(to, to_block, to_block->size);
+
+  return to_block;
+}
+
+/**
+ * @brief Moves a block to the end of a space.
+ *
+ * The block is copied by duplicate, and a forwarding pointer to the copy is
+ * left in the source block.
+ *
+ * @param from_block The block to move.
+ * @param to The space to move it to, with room for it.
+ * @return The copy.
+ */
+static Block_Header *evacuate(Block_Header *from_block, Heap_Header *to) {
+  Block_Header *to_block;
+
+  to_block = duplicate(from_block, to);
+
+  /* forwarding */
+  from_block->flags |= FL_COPIED;
+  from_block->next_free = to_block;
+
+  return to_block;
+}
+
+/**
+ * @brief Copy a block from the "from" heap to the "to" heap.
+ *
+ * This function evacuates a block, including its header, from the source
+ * heap to the destination heap. The age of the copy is incremented,
+ * saturating at MINI_CPGC_AGE_MAX, and its bytes are counted in the age
+ * histogram and, if enabled, the type histogram.
+ *
+ * @param from_block Pointer to the block in the "from" heap to be copied.
+ * @param to Pointer to the "to" heap.
+ * @return Returns a pointer to the new block in the "to" heap.
+ */
+Block_Header *copy(Block_Header *from_block, Heap_Header *to) {
+  Block_Header *to_block;
+
+  to_block = evacuate(from_block, to);
+  if (FL_AGE(to_block) < MINI_CPGC_AGE_MAX)
+    to_block->flags += (size_t)1 << FL_AGE_SHIFT;
+  age_histogram[FL_AGE(to_block)] += BLOCK_HEADER_SIZE + to_block->size;
+  if (FL_AGE(from_block) == 0)
+    sites[FL_SITE(from_block)].survived++;
+  if (type_histogram_enabled)
+    type_histogram_add(to_block);
+
+  return to_block;
+}
+
+/**
+ * @brief Finds the allocated block whose body contains ptr.
+ *
+ * Interior pointers are resolved through the object-start bitmap.
+ *
+ * @param h The heap to search.
+ * @param ptr A candidate pointer.
+ * @return The block in h, or NULL if ptr does not point into the body of an
+ * allocated block.
+ */
+static Block_Header *find_block(Heap_Header *h, void *ptr) {
+  Block_Header *p;
+
+  if ((size_t)ptr <= (size_t)(h + 1) || (size_t)ptr >= h->current)
+    return NULL;
+
+  p = start_find(h, ptr);
+  if (p == NULL || (size_t)ptr < (size_t)(p + 1) ||
+      (size_t)ptr >= (size_t)NEXT_HEADER(p) || !FL_TEST(p, FL_ALLOC))
+    return NULL;
+
+  return p;
+}
+
+/**
+ * @fn void *mini_cpgc_base(void *ptr)
+ * @brief Returns the start of the object a pointer points into.
+ *
+ * @param ptr A pointer into the body of an object, or any other value.
+ * @return The start of the object body, or NULL if ptr does not point into
+ * an allocated object.
+ */
+void *mini_cpgc_base(void *ptr) {
+  Block_Header *p;
+
+  p = find_block(from_start, ptr);
+  if (p == NULL)
+    p = find_block(old_start, ptr);
+  if (p == NULL)
+    p = find_block(perm_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+
+  return p != NULL ? (void *)(p + 1) : NULL;
+}
+
+/* ========================================================================== */
+/*  string dedup                                                              */
+/* ========================================================================== */
+
+#define DEDUP_LANES 4
+#define DEDUP_PRIME ((size_t)0x100000001b3ULL)
+#define DEDUP_MIN_CAP 64
+
+/**
+ * @fn void *mini_cpgc_string(const void *bytes, size_t len)
+ * @brief Allocates a byte string.
+ *
+ * The body is padded with zero bytes up to the block size. Strings are never
+ * scanned for pointers, and must not be modified once other code may hold
+ * them, since deduplication can make equal strings share one copy.
+ *
+ * @param bytes The contents of the string, which may lie in the heap.
+ * @param len The length of the string in bytes.
+ * @return A pointer to the string, or NULL if the allocation failed.
+ */
+void *mini_cpgc_string(const void *bytes, size_t len) {
+  Block_Header *p;
+  void *s, *src;
+
+  /* bytes may be part of a heap object that the allocation moves */
+  src = (void *)bytes;
+  mini_cpgc_add_root(&src);
+  s = mini_cpgc_malloc(len);
+  mini_cpgc_remove_root(&src);
+  if (s == NULL)
+    return NULL;
+  p = (Block_Header *)s - 1;
+  p->flags |= FL_STRING;
+  memset(s, 0, p->size);
+  memcpy(s, src, len);
+
+  return s;
+}
+
+/**
+ * @fn void mini_cpgc_set_dedup(int enable)
+ * @brief Enables or disables string deduplication during evacuation.
+ *
+ * @param enable Non-zero to merge equal strings into one copy.
+ */
+void mini_cpgc_set_dedup(int enable) { dedup_enabled = enable != 0; }
+
+/**
+ * @brief Hashes the body of a string block.
+ *
+ * The words are mixed into DEDUP_LANES independent lanes so the compiler can
+ * keep them in vector registers, and the lanes are folded at the end.
+ *
+ * @param p The string block.
+ * @return The hash of the body.
+ */
+static size_t dedup_hash(Block_Header *p) {
+  const size_t *word = (const size_t *)(p + 1);
+  size_t lane[DEDUP_LANES] = {0};
+  size_t n = p->size / PTRSIZE, h = p->size, i, j;
+
+  for (i = 0; i + DEDUP_LANES <= n; i += DEDUP_LANES)
+    for (j = 0; j < DEDUP_LANES; j++)
+      lane[j] = (lane[j] ^ word[i + j]) * DEDUP_PRIME;
+  for (; i < n; i++)
+    h = (h ^ word[i]) * DEDUP_PRIME;
+  for (j = 0; j < DEDUP_LANES; j++)
+    h = (h ^ lane[j]) * DEDUP_PRIME;
+
+  return h ^ (h >> 29);
+}
+
+/**
+ * @brief Inserts a canonical string into the deduplication table.
+ *
+ * The table is open addressed and doubles when it is half full.
+ *
+ * @param hash The hash of the string.
+ * @param block The string block in To-space.
+ */
+static void dedup_insert(size_t hash, Block_Header *block) {
+  Dedup_Entry *old = dedup_table;
+  size_t old_cap = dedup_cap, i;
+
+  if ((dedup_len + 1) * 2 > dedup_cap) {
+    dedup_cap = dedup_cap == 0 ? DEDUP_MIN_CAP : dedup_cap * 2;
+    dedup_table = calloc(dedup_cap, sizeof(*dedup_table));
+    if (dedup_table == NULL) {
+      /* stop deduplicating rather than fail the collection */
+      dedup_table = old;
+      dedup_cap = old_cap;
+      return;
+    }
+    dedup_len = 0;
+    for (i = 0; i < old_cap; i++)
+      if (old[i].block != NULL)
+        dedup_insert(old[i].hash, old[i].block);
+    free(old);
+  }
+
+  for (i = hash & (dedup_cap - 1); dedup_table[i].block != NULL;
+       i = (i + 1) & (dedup_cap - 1))
+    ;
+  dedup_table[i].hash = hash;
+  dedup_table[i].block = block;
+  dedup_len++;
+}
+
+/**
+ * @brief Evacuates a string, reusing an equal copy already in To-space.
+ *
+ * If an equal string was evacuated earlier in this collection, the block is
+ * forwarded to it instead of being copied.
+ *
+ * @param from_block The string block in From-space.
+ */
+static void dedup_copy(Block_Header *from_block) {
+  Block_Header *p;
+  size_t hash, i;
+
+  hash = dedup_hash(from_block);
+  for (i = hash & (dedup_cap - 1); dedup_cap != 0 &&
+                                   (p = dedup_table[i].block) != NULL;
+       i = (i + 1) & (dedup_cap - 1)) {
+    if (dedup_table[i].hash == hash && p->size == from_block->size &&
+        memcmp(p + 1, from_block + 1, p->size) == 0) {
+      from_block->flags |= FL_COPIED;
+      from_block->next_free = p;
+      /* p only records the address of the first string, maps rehash */
+      gc_epoch++;
+      return;
+    }
+  }
+
+  dedup_insert(hash, copy(from_block, to_start));
+}
+
+/**
+ * @brief Empties the deduplication table before a collection.
+ */
+static void dedup_reset(void) {
+  if (dedup_table != NULL)
+    memset(dedup_table, 0, dedup_cap * sizeof(*dedup_table));
+  dedup_len = 0;
+}
+
+/* ========================================================================== */
+/*  mark stack                                                                */
+/* ========================================================================== */
+
+#define MARK_STACK_SIZE 4096
+
+/*
+ * Marked blocks waiting to be scanned. The stack never grows: a block marked
+ * while it is full only sets mark_overflow, and is scanned when mark_rescan
+ * walks the marked blocks of its space once the stack has been drained.
+ * Scanning a block twice is harmless, so tracing needs no other memory.
+ */
+static Block_Header *mark_stack[MARK_STACK_SIZE];
+static size_t mark_len;
+static bool mark_overflow;
+
+/**
+ * @brief Queues a block that has just been marked.
+ *
+ * @param p The marked block.
+ */
+static void mark_push(Block_Header *p) {
+  if (mark_len == MARK_STACK_SIZE)
+    mark_overflow = true;
+  else
+    mark_stack[mark_len++] = p;
+}
+
+/**
+ * @brief Scans every marked block of a space after an overflow.
+ *
+ * @param h The space.
+ * @param scan The function scanning a block.
+ */
+static void mark_rescan(Heap_Header *h, void (*scan)(Block_Header *)) {
+  Block_Header *p;
+
+  for (p = (Block_Header *)(h + 1); (size_t)p < h->current;
+       p = NEXT_HEADER(p))
+    if (FL_TEST(p, FL_ALLOC | FL_MARK) == (FL_ALLOC | FL_MARK))
+      scan(p);
+}
+
+/* ========================================================================== */
+/*  tracing                                                                   */
+/* ========================================================================== */
+
+/**
+ * @brief Keeps a From-space block in place for the current collection.
+ *
+ * The block is marked and pushed on the mark stack like an old one, and aged
+ * and counted like copy does for a survivor.
+ *
+ * @param p The block.
+ */
+static void pin(Block_Header *p) {
+  if (FL_AGE(p) == 0)
+    sites[FL_SITE(p)].survived++;
+  if (FL_AGE(p) < MINI_CPGC_AGE_MAX)
+    p->flags += (size_t)1 << FL_AGE_SHIFT;
+  age_histogram[FL_AGE(p)] += BLOCK_HEADER_SIZE + p->size;
+  if (type_histogram_enabled)
+    type_histogram_add(p);
+  p->flags |= FL_MARK;
+  mark_push(p);
+}
+
+/**
+ * @brief Evacuates a From-space block into the old space.
+ *
+ * While blocks are pinned, From-space is kept rather than swapped, so the
+ * other survivors move to the old space instead of To-space. A block that
+ * does not fit there is pinned too.
+ *
+ * @param p The block.
+ */
+static void promote(Block_Header *p) {
+  Block_Header *q;
+  size_t size = p->size;
+
+  if (FL_TEST(p, FL_HASHED | FL_HASH_SLOT) == FL_HASHED)
+    size += PTRSIZE;
+  if (!HEAP_FITS(old_start, size)) {
+    pin(p);
+    return;
+  }
+  q = copy(p, old_start);
+  q->flags |= FL_MARK;
+  mark_push(q);
+}
+
+/**
+ * @brief Returns the new address of the object ptr points to.
+ *
+ * Objects not yet evacuated are copied to To-space, strings without an identity
+ * hash through dedup_copy when deduplication is enabled, or promoted to the
+ * old space while blocks are pinned; pinned blocks stay in place. Objects in
+ * the old and buddy spaces stay in place; the first time one is reached it is
+ * marked and pushed on the mark stack to be scanned, unless mini_cpgc_freeze
+ * moved it or the collection is minor. Interior pointers keep their offset
+ * into the object. Values that are not pointers to allocated objects are
+ * returned unchanged.
+ *
+ * @param ptr A candidate pointer.
+ * @return The forwarded pointer.
+ */
+static void *forward(void *ptr) {
+  Block_Header *p;
+
+  p = find_block(from_start, ptr);
+  if (p != NULL) {
+    if (!FL_TEST(p, FL_COPIED | FL_MARK)) {
+      if (pinning)
+        promote(p);
+      else if (dedup_enabled && FL_TEST(p, FL_STRING) &&
+               !FL_TEST(p, FL_HASHED))
+        dedup_copy(p);
+      else
+        copy(p, to_start);
+    }
+    if (FL_TEST(p, FL_MARK))
+      return ptr;
+    return (void *)((size_t)p->next_free + ((size_t)ptr - (size_t)p));
+  }
+
+  p = find_block(old_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+  if (p != NULL && FL_TEST(p, FL_COPIED))
+    return (void *)((size_t)p->next_free + ((size_t)ptr - (size_t)p));
+  if (minor_collection)
+    return ptr;
+  if (p != NULL && !FL_TEST(p, FL_MARK)) {
+    p->flags |= FL_MARK;
+    mark_push(p);
+    if (type_histogram_enabled)
+      type_histogram_add(p);
+  }
+  if (p == NULL && leak_check_fp != NULL)
+    leak_check_freed(ptr);
+
+  return ptr;
+}
+
+/**
+ * @brief Queues an ephemeron for ephemeron_step.
+ *
+ * A block is flagged FL_QUEUED while it is queued, so an old ephemeron that
+ * mark_rescan scans again is not queued twice.
+ *
+ * @param p The ephemeron block.
+ */
+static void ephemeron_push(Block_Header *p) {
+  Block_Header **q;
+
+  if (FL_TEST(p, FL_QUEUED))
+    return;
+  if (ephemerons_len == ephemerons_cap) {
+    ephemerons_cap = ephemerons_cap == 0 ? 16 : ephemerons_cap * 2;
+    q = realloc(ephemerons, ephemerons_cap * sizeof(*ephemerons));
+    if (q == NULL) {
+      perror("ephemeron_push");
+      exit(EXIT_FAILURE);
+    }
+    ephemerons = q;
+  }
+  p->flags |= FL_QUEUED;
+  ephemerons[ephemerons_len++] = p;
+}
+
+/**
+ * @brief Forwards every pointer held in the body of a To-space block.
+ *
+ * Object layouts are unknown, so every aligned word is treated as a candidate
+ * pointer and only rewritten if it points to an allocated object. Strings and
+ * pointer-free blocks are skipped, and ephemerons are not scanned but queued
+ * for ephemeron_step.
+ *
+ * @param p The block to scan.
+ */
+static void scan_block(Block_Header *p) {
+  void **field;
+
+  if (FL_TEST(p, FL_STRING | FL_NOSCAN))
+    return;
+  if (FL_TEST(p, FL_EPHEMERON)) {
+    ephemeron_push(p);
+    return;
+  }
+
+  for (field = (void **)(p + 1); (size_t)field < BODY_END(p); field++)
+    *field = forward(*field);
+}
+
+/**
+ * @brief Scans a marked old or buddy block.
+ *
+ * @param p The block.
+ */
+static void scan_marked(Block_Header *p) {
+  scan_block(p);
+  wp_remember(p);
+}
+
+/**
+ * @brief Scans the evacuated and marked objects until none is left.
+ *
+ * @param scan The Cheney scan pointer into To-space, advanced in place.
+ */
+static void trace(Block_Header **scan) {
+  for (;;) {
+    for (; (size_t)*scan < to_start->current; *scan = NEXT_HEADER(*scan))
+      scan_block(*scan);
+    if (mark_len > 0) {
+      scan_marked(mark_stack[--mark_len]);
+      continue;
+    }
+    if (!mark_overflow)
+      break;
+    mark_overflow = false;
+    if (pinning)
+      mark_rescan(from_start, scan_marked);
+    mark_rescan(old_start, scan_marked);
+    if (buddy_start != NULL)
+      mark_rescan(buddy_start, scan_marked);
+  }
+}
+
+/**
+ * @brief Scans the permanent space, which holds roots for every collection.
+ */
+static void scan_permanent(void) {
+  Block_Header *p;
+
+  for (p = (Block_Header *)(perm_start + 1); (size_t)p < perm_start->current;
+       p = NEXT_HEADER(p))
+    if (!FL_TEST(p, FL_NOSCAN))
+      scan_block(p);
+}
+
+/* ========================================================================== */
+/*  data segment roots                                                        */
+/* ========================================================================== */
+
+/**
+ * @fn void mini_cpgc_set_scan_data_segments(int enable)
+ * @brief Enables or disables scanning global variables as roots.
+ *
+ * When enabled, every collection conservatively scans the writable segments
+ * of the executable and the loaded libraries, so heap pointers held in global
+ * variables need not be registered with mini_cpgc_add_root. The variables are
+ * never written: the objects they point to are pinned instead.
+ *
+ * @param enable Non-zero to scan the data and BSS segments.
+ */
+void mini_cpgc_set_scan_data_segments(int enable) {
+  data_scan_enabled = enable != 0;
+}
+
+/**
+ * @brief dl_iterate_phdr callback reading the load and unload counters.
+ */
+static int data_counters(struct dl_phdr_info *info, size_t size, void *arg) {
+  (void)size;
+  (void)arg;
+  data_adds = info->dlpi_adds;
+  data_subs = info->dlpi_subs;
+
+  return 1;
+}
+
+/**
+ * @brief dl_iterate_phdr callback collecting the writable PT_LOAD segments.
+ */
+static int data_collect(struct dl_phdr_info *info, size_t size, void *arg) {
+  const ElfW(Phdr) *ph;
+  Data_Range *ranges;
+  size_t *cap = arg;
+  int i;
+
+  (void)size;
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    ph = &info->dlpi_phdr[i];
+    if (ph->p_type != PT_LOAD || !(ph->p_flags & PF_W))
+      continue;
+    if (data_ranges_len == *cap) {
+      *cap = *cap == 0 ? 16 : *cap * 2;
+      ranges = realloc(data_ranges, *cap * sizeof(*data_ranges));
+      if (ranges == NULL)
+        return 1;
+      data_ranges = ranges;
+    }
+    data_ranges[data_ranges_len].start = (void **)ALIGN(
+        (size_t)(info->dlpi_addr + ph->p_vaddr), PTRSIZE);
+    data_ranges[data_ranges_len].end =
+        (void **)(info->dlpi_addr + ph->p_vaddr + ph->p_memsz);
+    data_ranges_len++;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Brings the cached segment list up to date.
+ *
+ * Reading the counters only visits the first object, so the full list is
+ * rebuilt only after a library was loaded or unloaded.
+ */
+static void data_refresh(void) {
+  unsigned long long adds = data_adds, subs = data_subs;
+  size_t cap;
+
+  dl_iterate_phdr(data_counters, NULL);
+  if (data_ranges != NULL && adds == data_adds && subs == data_subs)
+    return;
+
+  free(data_ranges);
+  data_ranges = NULL;
+  data_ranges_len = 0;
+  cap = 0;
+  dl_iterate_phdr(data_collect, &cap);
+}
+
+/**
+ * @brief Tells whether a global variable points into From-space.
+ *
+ * The scan reads between variables, which AddressSanitizer would report.
+ *
+ * @return true if a collection would have to pin blocks.
+ */
+__attribute__((no_sanitize_address)) static bool data_pins(void) {
+  void **field;
+  size_t i;
+
+  if (!data_scan_enabled)
+    return false;
+  data_refresh();
+  for (i = 0; i < data_ranges_len; i++)
+    for (field = data_ranges[i].start; field + 1 <= data_ranges[i].end;
+         field++)
+      if (find_block(from_start, *field) != NULL)
+        return true;
+
+  return false;
+}
+
+/**
+ * @brief Marks the objects referenced from global variables.
+ *
+ * A word may just be an integer that looks like a pointer, so it is never
+ * written. The From-space blocks the words point into are pinned instead,
+ * and the collection then promotes the other survivors to the old space and
+ * keeps From-space. Objects elsewhere never move during a collection. The
+ * scan reads between variables, which AddressSanitizer would report.
+ *
+ * @return true if a block was pinned.
+ */
+__attribute__((no_sanitize_address)) static bool scan_data_segments(void) {
+  Block_Header *p;
+  void **field;
+  size_t i;
+  bool pinned = false;
+
+  if (!data_scan_enabled)
+    return false;
+  data_refresh();
+  for (i = 0; i < data_ranges_len; i++) {
+    for (field = data_ranges[i].start; field + 1 <= data_ranges[i].end;
+         field++) {
+      p = find_block(from_start, *field);
+      if (p == NULL) {
+        forward(*field);
+      } else if (!FL_TEST(p, FL_MARK)) {
+        pin(p);
+        pinned = true;
+      }
+    }
+  }
+
+  return pinned;
+}
+
+/**
+ * @brief Frees From-space around the pinned blocks after a collection.
+ *
+ * Every other block was promoted or is dead. Each run of them between two
+ * pinned blocks becomes a single free block, and the run after the last one
+ * is given back to bump allocation.
+ */
+static void pin_sweep(void) {
+  Block_Header *p, *next, *run = NULL;
+
+  free_reset();
+  for (p = (Block_Header *)(from_start + 1); (size_t)p < from_start->current;
+       p = next) {
+    next = NEXT_HEADER(p);
+    if (!FL_TEST(p, FL_MARK)) {
+      if (run == NULL)
+        run = p;
+      else
+        start_clear(from_start, p);
+      continue;
+    }
+    p->flags &= ~(size_t)(FL_MARK | FL_PREV_FREE);
+    if (run != NULL) {
+      run->flags = FL_FREE;
+      run->size = (size_t)p - (size_t)(run + 1);
+      free_link(run);
+      run = NULL;
+    }
+  }
+  if (run != NULL) {
+    start_clear(from_start, run);
+    from_start->current = (size_t)run;
+  }
+}
+
+/* ========================================================================== */
+/*  write protection                                                          */
+/* ========================================================================== */
+
+#define WP_FULL_INTERVAL 8
+#define WP_SPAN(h) ALIGN((h)->end - (size_t)(h), wp_page_size)
+#define WP_WORDS(h) (ALIGN(WP_SPAN(h) / wp_page_size, WORD_BITS) / WORD_BITS)
+
+/*
+ * The old and buddy spaces are write protected after each collection, except
+ * for the pages holding pointers to From-space. The first write to another
+ * page faults, and page_fault marks it dirty and makes it writable, so a
+ * minor collection finds every old object that may point to From-space on a
+ * dirty page, without a barrier in the program. wp_spaces lists the protected
+ * spaces of every heap. The handler is shared with mini_cpgc_compact, and is
+ * installed while either needs it.
+ */
+static bool wp_enabled;
+static size_t wp_page_size;
+static size_t wp_minors;
+static Heap_Header **wp_spaces;
+static size_t wp_spaces_len;
+static int fault_users;
+static struct sigaction fault_old_action;
+
+/**
+ * @brief SIGSEGV handler for the protected pages of the collector.
+ *
+ * Pages of a lazy compaction are populated; the first write to a write
+ * protected page is recorded. Other faults are passed to the previous
+ * handler.
+ */
+static void page_fault(int sig, siginfo_t *info, void *context) {
+  size_t addr = (size_t)info->si_addr, page, i;
+  Heap_Header *h;
+
+  if (compact_fault(addr))
+    return;
+  for (i = 0; i < wp_spaces_len; i++) {
+    h = wp_spaces[i];
+    if (addr < (size_t)h || addr >= (size_t)h + WP_SPAN(h))
+      continue;
+    page = (addr - (size_t)h) / wp_page_size;
+    h->dirty[page / WORD_BITS] |= (size_t)1 << (page % WORD_BITS);
+    mprotect((void *)((size_t)h + page * wp_page_size), wp_page_size,
+             PROT_READ | PROT_WRITE);
+    return;
+  }
+
+  if (fault_old_action.sa_flags & SA_SIGINFO)
+    fault_old_action.sa_sigaction(sig, info, context);
+  else if (fault_old_action.sa_handler != SIG_DFL &&
+           fault_old_action.sa_handler != SIG_IGN)
+    fault_old_action.sa_handler(sig);
+  else
+    sigaction(sig, &fault_old_action, NULL); /* the access faults again */
+}
+
+/**
+ * @brief Installs page_fault for one more user.
+ *
+ * @return false if the handler could not be installed.
+ */
+static bool fault_acquire(void) {
+  struct sigaction action;
+
+  if (fault_users == 0) {
+    wp_page_size = OS_PAGE_SIZE;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = page_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &fault_old_action) != 0)
+      return false;
+  }
+  fault_users++;
+
+  return true;
+}
+
+/**
+ * @brief Restores the previous handler once page_fault has no user left.
+ */
+static void fault_release(void) {
+  if (--fault_users == 0)
+    sigaction(SIGSEGV, &fault_old_action, NULL);
+}
+
+/**
+ * @fn int mini_cpgc_set_write_protect(int enable)
+ * @brief Enables or disables dirty page tracking by write protection.
+ *
+ * When enabled, collections triggered by allocation are minor, with a full
+ * one every WP_FULL_INTERVAL collections, and the old and buddy spaces are
+ * protected from the end of the next collection on. System calls writing to
+ * a protected page fail with EFAULT instead of faulting. Leak checks disable
+ * minor collections.
+ *
+ * @param enable Non-zero to protect the spaces.
+ * @return Non-zero on success, zero if the signal handler could not be
+ * installed.
+ */
+int mini_cpgc_set_write_protect(int enable) {
+  if ((enable != 0) == wp_enabled)
+    return 1;
+  if (!enable) {
+    while (wp_spaces_len > 0)
+      wp_release(wp_spaces[wp_spaces_len - 1]);
+    fault_release();
+    wp_enabled = false;
+    return 1;
+  }
+
+  if (!fault_acquire())
+    return 0;
+  wp_enabled = true;
+
+  return 1;
+}
+
+/**
+ * @brief Unprotects a space and drops its dirty pages.
+ *
+ * @param h The space, protected or not.
+ */
+static void wp_release(Heap_Header *h) {
+  size_t i;
+
+  if (h->dirty == NULL)
+    return;
+  for (i = 0; wp_spaces[i] != h; i++)
+    ;
+  wp_spaces[i] = wp_spaces[--wp_spaces_len];
+  mprotect(h, WP_SPAN(h), PROT_READ | PROT_WRITE);
+  free(h->dirty);
+  h->dirty = NULL;
+  h->remembered = NULL;
+}
+
+/**
+ * @brief Protects the clean pages of a space.
+ *
+ * The pages remembered by the collection become the dirty ones. A space is
+ * registered the first time; if memory runs out it stays unprotected.
+ *
+ * @param h The space.
+ */
+static void wp_protect_space(Heap_Header *h) {
+  Heap_Header **spaces;
+  size_t words = WP_WORDS(h), pages = WP_SPAN(h) / wp_page_size, i, j;
+  bool dirty;
+
+  if (h->dirty == NULL) {
+    spaces = realloc(wp_spaces, (wp_spaces_len + 1) * sizeof(*wp_spaces));
+    if (spaces == NULL)
+      return;
+    wp_spaces = spaces;
+    h->dirty = calloc(2 * words, sizeof(size_t));
+    if (h->dirty == NULL)
+      return;
+    h->remembered = h->dirty + words;
+    wp_spaces[wp_spaces_len++] = h;
+  }
+  memcpy(h->dirty, h->remembered, words * sizeof(size_t));
+  memset(h->remembered, 0, words * sizeof(size_t));
+
+  for (i = 0; i < pages; i = j) {
+    dirty = (h->dirty[i / WORD_BITS] >> (i % WORD_BITS)) & 1;
+    for (j = i + 1; j < pages; j++)
+      if (((h->dirty[j / WORD_BITS] >> (j % WORD_BITS)) & 1) != dirty)
+        break;
+    mprotect((void *)((size_t)h + i * wp_page_size), (j - i) * wp_page_size,
+             dirty ? PROT_READ | PROT_WRITE : PROT_READ);
+  }
+}
+
+/**
+ * @brief Protects the old and buddy spaces at the end of a collection.
+ */
+static void wp_protect(void) {
+  if (!wp_enabled)
+    return;
+  wp_protect_space(old_start);
+  if (buddy_start != NULL)
+    wp_protect_space(buddy_start);
+}
+
+/**
+ * @brief Unprotects the old and buddy spaces for a full collection.
+ *
+ * Marking and sweeping write to every live page, which would otherwise
+ * fault one page at a time.
+ */
+static void wp_begin(void) {
+  if (minor_collection)
+    return;
+  wp_minors = 0;
+  if (old_start->dirty != NULL)
+    mprotect(old_start, WP_SPAN(old_start), PROT_READ | PROT_WRITE);
+  if (buddy_start != NULL && buddy_start->dirty != NULL)
+    mprotect(buddy_start, WP_SPAN(buddy_start), PROT_READ | PROT_WRITE);
+}
+
+/**
+ * @brief Remembers the pages of an old or buddy block that point to To-space.
+ *
+ * While blocks are pinned the young objects stay in From-space, so pointers
+ * to it are remembered instead. Ephemerons are forwarded later, so their
+ * pages are always remembered.
+ *
+ * @param p A block that has just been scanned.
+ */
+static void wp_remember(Block_Header *p) {
+  Heap_Header *h = IN_HEAP(old_start, p) ? old_start : buddy_start;
+  Heap_Header *young = pinning ? from_start : to_start;
+  void **field;
+  size_t page;
+
+  if (h == NULL || !IN_HEAP(h, p) || h->remembered == NULL ||
+      FL_TEST(p, FL_STRING | FL_NOSCAN))
+    return;
+  for (field = (void **)(p + 1); (size_t)field < BODY_END(p); field++) {
+    if (!FL_TEST(p, FL_EPHEMERON) && !IN_HEAP(young, *field))
+      continue;
+    page = ((size_t)field - (size_t)h) / wp_page_size;
+    h->remembered[page / WORD_BITS] |= (size_t)1 << (page % WORD_BITS);
+  }
+}
+
+/**
+ * @brief Scans the allocated blocks on the dirty pages of a space.
+ *
+ * A block spanning several dirty pages is scanned once.
+ *
+ * @param h The space.
+ */
+static void wp_scan_space(Heap_Header *h) {
+  Block_Header *p = (Block_Header *)(h + 1);
+  size_t pages = WP_SPAN(h) / wp_page_size, i, start;
+
+  for (i = 0; i < pages; i++) {
+    if (!((h->dirty[i / WORD_BITS] >> (i % WORD_BITS)) & 1))
+      continue;
+    start = (size_t)h + i * wp_page_size;
+    if (start >= h->current)
+      break;
+    if ((size_t)p < start && start > (size_t)(h + 1))
+      p = start_find(h, (void *)start);
+    for (; (size_t)p < h->current && (size_t)p < start + wp_page_size;
+         p = NEXT_HEADER(p)) {
+      if (!FL_TEST(p, FL_ALLOC))
+        continue;
+      scan_block(p);
+      wp_remember(p);
+    }
+  }
+}
+
+/**
+ * @brief Scans the dirty pages as roots of a minor collection.
+ */
+static void wp_scan_dirty(void) {
+  if (!minor_collection)
+    return;
+  wp_scan_space(old_start);
+  if (buddy_start != NULL)
+    wp_scan_space(buddy_start);
+}
+
+/**
+ * @brief Runs a minor collection if the dirty pages are known.
+ *
+ * Every space to scan must have been protected by an earlier collection,
+ * and a leak check needs the full trace.
+ *
+ * @return true if a minor collection ran.
+ */
+static bool collect_minor(size_t req_size) {
+  if (!wp_enabled || leak_check_fp != NULL || old_start->dirty == NULL ||
+      (buddy_start != NULL && buddy_start->dirty == NULL) || data_pins())
+    return false;
+  minor_collection = true;
+  collect(req_size);
+  minor_collection = false;
+
+  return true;
+}
+
+/**
+ * @brief Collects on behalf of an allocation.
+ *
+ * @param req_size The allocation that triggered the collection.
+ */
+static void collect_young(size_t req_size) {
+  if (wp_minors + 1 < WP_FULL_INTERVAL && collect_minor(req_size)) {
+    wp_minors++;
+    return;
+  }
+  collect(req_size);
+}
+
+/**
+ * @fn void mini_cpgc_minor_collect(void)
+ * @brief Collects From-space only, taking the old and buddy objects as live.
+ *
+ * Falls back to a full collection unless write protection is enabled and a
+ * collection has protected the spaces since.
+ */
+void mini_cpgc_minor_collect(void) {
+  if (!collect_minor(0))
+    collect(0);
+}
+
+/* ========================================================================== */
+/*  ephemeron                                                                 */
+/* ========================================================================== */
+
+/**
+ * @fn void *mini_cpgc_ephemeron(void *key, void *value)
+ * @brief Allocates an ephemeron.
+ *
+ * The body of an ephemeron holds the key and the value, in that order. The
+ * value is kept alive only while the key is reachable other than through the
+ * ephemeron; once the key dies, the collector clears both fields to NULL.
+ *
+ * @param key The key object.
+ * @param value The value object.
+ * @return A pointer to the ephemeron, or NULL if the allocation failed.
+ */
+void *mini_cpgc_ephemeron(void *key, void *value) {
+  void **e;
+
+  /* the allocation may collect and move both */
+  mini_cpgc_add_root(&key);
+  mini_cpgc_add_root(&value);
+  e = mini_cpgc_malloc(2 * PTRSIZE);
+  mini_cpgc_remove_root(&value);
+  mini_cpgc_remove_root(&key);
+  if (e == NULL)
+    return NULL;
+
+  ((Block_Header *)e - 1)->flags |= FL_EPHEMERON;
+  e[0] = key;
+  e[1] = value;
+
+  return (void *)e;
+}
+
+/**
+ * @brief Tells whether the trace has reached the object ptr points to.
+ *
+ * Values that are not pointers to allocated objects count as reached, and so
+ * do old and buddy objects in a minor collection.
+ *
+ * @param ptr A candidate pointer.
+ * @return true if the object has been evacuated or marked.
+ */
+static bool is_reached(void *ptr) {
+  Block_Header *p;
+
+  p = find_block(from_start, ptr);
+  if (p != NULL)
+    return FL_TEST(p, FL_COPIED | FL_MARK);
+  p = find_block(old_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+  if (p != NULL)
+    return minor_collection || FL_TEST(p, FL_MARK);
+
+  return true;
+}
+
+/**
+ * @brief Traces the values of the queued ephemerons whose key is reached.
+ *
+ * Each ephemeron that is resolved is removed from the queue. The caller has
+ * to trace again and repeat until no ephemeron is resolved.
+ *
+ * @return true if any ephemeron was resolved.
+ */
+static bool ephemeron_step(void) {
+  void **body;
+  size_t i, n;
+  bool progress = false;
+
+  for (i = 0, n = 0; i < ephemerons_len; i++) {
+    body = (void **)(ephemerons[i] + 1);
+    if (!is_reached(body[0])) {
+      ephemerons[n++] = ephemerons[i];
+      continue;
+    }
+    ephemerons[i]->flags &= ~(size_t)FL_QUEUED;
+    body[0] = forward(body[0]);
+    body[1] = forward(body[1]);
+    progress = true;
+  }
+  ephemerons_len = n;
+
+  return progress;
+}
+
+/**
+ * @brief Clears the ephemerons whose key was not reached.
+ */
+static void ephemeron_clear(void) {
+  size_t i;
+
+  for (i = 0; i < ephemerons_len; i++) {
+    ephemerons[i]->flags &= ~(size_t)FL_QUEUED;
+    ((void **)(ephemerons[i] + 1))[0] = NULL;
+    ((void **)(ephemerons[i] + 1))[1] = NULL;
+  }
+  ephemerons_len = 0;
+}
+
+/* ========================================================================== */
+/*  map                                                                       */
+/* ========================================================================== */
+
+#define MAP_MIN_CAP 16
+
+/**
+ * @fn Mini_Cpgc_Map *mini_cpgc_map_new(void)
+ * @brief Creates a hash map keyed by heap object identity.
+ *
+ * Keys and values are strong references, updated when the objects move.
+ * Buckets go stale when a collection moves the keys; instead of rehashing
+ * the whole map, each lookup migrates only the stale bucket holding its key,
+ * found through the address the key had before the collection. Freezing and
+ * string deduplication lose that address, and advance the epoch an extra
+ * step so that the maps are rehashed.
+ *
+ * @return The map, or NULL if it could not be allocated.
+ */
+Mini_Cpgc_Map *mini_cpgc_map_new(void) {
+  Mini_Cpgc_Map *map;
+
+  map = calloc(1, sizeof(*map));
+  if (map == NULL)
+    return NULL;
+  map->epoch = gc_epoch;
+  map->next = maps;
+  maps = map;
+
+  return map;
+}
+
+/**
+ * @brief Frees the entries and buckets of a map table.
+ *
+ * @param t The table.
+ */
+static void map_table_free(Map_Table *t) {
+  Map_Entry *e, *next;
+  size_t i;
+
+  for (i = 0; i < t->cap; i++) {
+    for (e = t->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      free(e);
+    }
+  }
+  free(t->buckets);
+  memset(t, 0, sizeof(*t));
+}
+
+/**
+ * @fn void mini_cpgc_map_delete(Mini_Cpgc_Map *map)
+ * @brief Destroys a map created by mini_cpgc_map_new.
+ *
+ * @param map The map.
+ */
+void mini_cpgc_map_delete(Mini_Cpgc_Map *map) {
+  Mini_Cpgc_Map **link;
+
+  for (link = &maps; *link != NULL; link = &(*link)->next) {
+    if (*link == map) {
+      *link = map->next;
+      break;
+    }
+  }
+  map_table_free(&map->cur);
+  map_table_free(&map->stale);
+  free(map);
+}
+
+/**
+ * @brief Links an entry into the bucket of its key's current address.
+ *
+ * @param t The table, with at least one bucket.
+ * @param e The entry.
+ */
+static void map_link(Map_Table *t, Map_Entry *e) {
+  Map_Entry **bucket = &t->buckets[address_hash(e->key) & (t->cap - 1)];
+
+  e->next = *bucket;
+  *bucket = e;
+  t->len++;
+}
+
+/**
+ * @brief Doubles the bucket array of a table once it holds cap entries.
+ *
+ * @param t The table.
+ * @return false if the bucket array could not be allocated.
+ */
+static bool map_reserve(Map_Table *t) {
+  Map_Table grown;
+  Map_Entry *e, *next;
+  size_t i;
+
+  if (t->len < t->cap)
+    return true;
+  grown.cap = t->cap == 0 ? MAP_MIN_CAP : t->cap * 2;
+  grown.len = 0;
+  grown.buckets = calloc(grown.cap, sizeof(*grown.buckets));
+  if (grown.buckets == NULL)
+    return t->cap != 0;
+
+  for (i = 0; i < t->cap; i++) {
+    for (e = t->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      map_link(&grown, e);
+    }
+  }
+  free(t->buckets);
+  *t = grown;
+
+  return true;
+}
+
+/**
+ * @brief Moves every entry of a stale bucket to the current table.
+ *
+ * @param map The map.
+ * @param bucket The stale bucket.
+ */
+static void map_migrate(Mini_Cpgc_Map *map, Map_Entry **bucket) {
+  Map_Entry *e;
+
+  while ((e = *bucket) != NULL) {
+    *bucket = e->next;
+    map->stale.len--;
+    map_reserve(&map->cur);
+    map_link(&map->cur, e);
+  }
+}
+
+/**
+ * @brief Brings a map up to date with the collections since its last use.
+ *
+ * After one collection the current table becomes the stale one and is
+ * migrated bucket by bucket. After more, or with entries still stale from an
+ * earlier collection, the addresses they were hashed with are lost and the
+ * whole map is rehashed.
+ *
+ * @param map The map.
+ */
+static void map_sync(Mini_Cpgc_Map *map) {
+  Map_Table tmp;
+  size_t i;
+
+  if (map->epoch == gc_epoch)
+    return;
+
+  if (map->epoch + 1 != gc_epoch || map->stale.len != 0) {
+    for (i = 0; i < map->stale.cap; i++)
+      map_migrate(map, &map->stale.buckets[i]);
+    /* the emptied stale buckets take the entries rehashed now */
+    tmp = map->stale;
+    map->stale = map->cur;
+    map->cur = tmp;
+    for (i = 0; i < map->stale.cap; i++)
+      map_migrate(map, &map->stale.buckets[i]);
+  } else {
+    tmp = map->stale;
+    map->stale = map->cur;
+    map->cur = tmp;
+    if (map->cur.buckets != NULL)
+      memset(map->cur.buckets, 0, map->cur.cap * sizeof(*map->cur.buckets));
+  }
+  map->epoch = gc_epoch;
+}
+
+/**
+ * @brief Finds the entry of a key, migrating its stale bucket if needed.
+ *
+ * @param map The map.
+ * @param key The key.
+ * @return The link pointing to the entry, or NULL if the key is absent.
+ */
+static Map_Entry **map_find(Mini_Cpgc_Map *map, void *key) {
+  Block_Header *p, *prev;
+  Map_Entry **link;
+  void *old_key = key;
+
+  map_sync(map);
+
+  if (map->stale.len != 0) {
+    p = (Block_Header *)key - 1;
+    if (IN_HEAP(from_start, key)) {
+      prev = p->next_free;
+      if (prev != NULL)
+        old_key = prev + 1;
+    }
+    map_migrate(
+        map, &map->stale.buckets[address_hash(old_key) & (map->stale.cap - 1)]);
+  }
+
+  if (map->cur.cap == 0)
+    return NULL;
+  for (link = &map->cur.buckets[address_hash(key) & (map->cur.cap - 1)];
+       *link != NULL; link = &(*link)->next)
+    if ((*link)->key == key)
+      return link;
+
+  return NULL;
+}
+
+/**
+ * @fn void *mini_cpgc_map_get(Mini_Cpgc_Map *map, void *key)
+ * @brief Looks up the value of a key.
+ *
+ * @param map The map.
+ * @param key The key object.
+ * @return The value, or NULL if the key is absent.
+ */
+void *mini_cpgc_map_get(Mini_Cpgc_Map *map, void *key) {
+  Map_Entry **link = map_find(map, key);
+
+  return link != NULL ? (*link)->value : NULL;
+}
+
+/**
+ * @fn int mini_cpgc_map_put(Mini_Cpgc_Map *map, void *key, void *value)
+ * @brief Associates a value with a key.
+ *
+ * @param map The map.
+ * @param key The key object.
+ * @param value The value object.
+ * @return Non-zero on success, zero if memory ran out.
+ */
+int mini_cpgc_map_put(Mini_Cpgc_Map *map, void *key, void *value) {
+  Map_Entry **link, *e;
+
+  link = map_find(map, key);
+  if (link != NULL) {
+    (*link)->value = value;
+    return 1;
+  }
+
+  e = malloc(sizeof(*e));
+  if (e == NULL || !map_reserve(&map->cur)) {
+    free(e);
+    return 0;
+  }
+  e->key = key;
+  e->value = value;
+  map_link(&map->cur, e);
+
+  return 1;
+}
+
+/**
+ * @fn int mini_cpgc_map_remove(Mini_Cpgc_Map *map, void *key)
+ * @brief Removes a key and its value.
+ *
+ * @param map The map.
+ * @param key The key object.
+ * @return Non-zero if the key was present.
+ */
+int mini_cpgc_map_remove(Mini_Cpgc_Map *map, void *key) {
+  Map_Entry **link, *e;
+
+  link = map_find(map, key);
+  if (link == NULL)
+    return 0;
+  e = *link;
+  *link = e->next;
+  map->cur.len--;
+  free(e);
+
+  return 1;
+}
+
+/**
+ * @brief Forwards the keys and values of a map table.
+ *
+ * @param t The table.
+ */
+static void map_table_forward(Map_Table *t) {
+  Map_Entry *e;
+  size_t i;
+
+  for (i = 0; i < t->cap; i++) {
+    for (e = t->buckets[i]; e != NULL; e = e->next) {
+      e->key = forward(e->key);
+      e->value = forward(e->value);
+    }
+  }
+}
+
+/**
+ * @brief Forwards the entries of every map, as roots of the collection.
+ *
+ * Entries keep their buckets; the maps catch up lazily in map_sync.
+ */
+static void map_forward_all(void) {
+  Mini_Cpgc_Map *map;
+
+  for (map = maps; map != NULL; map = map->next) {
+    map_table_forward(&map->cur);
+    map_table_forward(&map->stale);
+  }
+}
+
+/* ========================================================================== */
+/*  freeze                                                                    */
+/* ========================================================================== */
+
+/**
+ * @brief Moves an object reachable from a frozen root into the frozen space.
+ *
+ * Objects in From-space, the old space and the buddy space are evacuated
+ * without ageing them or counting them as survivors of their site; anything
+ * else (the permanent space, earlier frozen spaces, non-pointers) never
+ * moves.
+ *
+ * @param h The frozen space being populated.
+ * @param ptr A candidate pointer.
+ * @return The forwarded pointer.
+ */
+static void *freeze_forward(Heap_Header *h, void *ptr) {
+  Block_Header *p;
+
+  p = find_block(from_start, ptr);
+  if (p == NULL)
+    p = find_block(old_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+  if (p == NULL)
+    return ptr;
+  if (!FL_TEST(p, FL_COPIED))
+    evacuate(p, h);
+
+  return (void *)((size_t)p->next_free + ((size_t)ptr - (size_t)p));
+}
+
+/**
+ * @brief Tells whether a global variable points to an object being frozen.
+ *
+ * Global variables are never rewritten, so such an object must not move.
+ * The scan reads between variables, which AddressSanitizer would report.
+ *
+ * @return true if a scanned global points into a forwarded block.
+ */
+__attribute__((no_sanitize_address)) static bool freeze_pinned(void) {
+  Block_Header *p;
+  void **field;
+  size_t i;
+
+  if (!data_scan_enabled)
+    return false;
+  data_refresh();
+  for (i = 0; i < data_ranges_len; i++) {
+    for (field = data_ranges[i].start; field + 1 <= data_ranges[i].end;
+         field++) {
+      p = find_block(from_start, *field);
+      if (p == NULL)
+        p = find_block(old_start, *field);
+      if (p == NULL && buddy_start != NULL)
+        p = find_block(buddy_start, *field);
+      if (p != NULL && FL_TEST(p, FL_COPIED))
+        return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * @brief Abandons a frozen space before it is protected.
+ *
+ * The originals lose their forwarding, and with it the addresses maps find
+ * their stale buckets by, so the maps are rehashed.
+ *
+ * @param h The frozen space, the last one.
+ */
+static void freeze_undo(Heap_Header *h) {
+  Block_Header *scan;
+
+  for (scan = (Block_Header *)(h + 1); (size_t)scan < h->current;
+       scan = NEXT_HEADER(scan)) {
+    scan->next_free->flags &= ~(size_t)FL_COPIED;
+    scan->next_free->next_free = NULL;
+  }
+  frozen_len--;
+  space_free(h);
+  gc_epoch += 2;
+}
+
+/**
+ * @fn void *mini_cpgc_freeze(void *root)
+ * @brief Moves the graph reachable from root into a new read-only space.
+ *
+ * The graph is evacuated in Cheney order into a space sized for the worst
+ * case, of which only the pages used are ever touched, and the space is then
+ * write protected. A collection follows, redirecting every other reference
+ * to the frozen copies. Frozen objects are never moved nor scanned again:
+ * they cannot point outside the frozen and permanent spaces. Ephemerons are
+ * frozen with both fields strong, and writing to a frozen object faults.
+ *
+ * @param root A pointer to the root object.
+ * @return The frozen copy of root, or root itself if it is not a heap
+ * object, the space could not be allocated, or a global variable scanned as
+ * a root points into the graph.
+ */
+void *mini_cpgc_freeze(void *root) {
+  Heap_Header *h, **list;
+  Block_Header *scan;
+  void **field, *copy_root;
+  size_t size;
+
+  if (find_block(from_start, root) == NULL &&
+      find_block(old_start, root) == NULL &&
+      (buddy_start == NULL || find_block(buddy_start, root) == NULL))
+    return root;
+
+  /* room for every object, and a hash slot for each */
+  size = HEAP_USED(from_start) + HEAP_USED(old_start) +
+         (buddy_start != NULL ? HEAP_USED(buddy_start) : 0);
+  h = space_alloc(size + size / (BLOCK_HEADER_SIZE + PTRSIZE) * PTRSIZE);
+  list = realloc(frozen, (frozen_len + 1) * sizeof(*frozen));
+  if (h == NULL || list == NULL) {
+    space_free(h);
+    return root;
+  }
+  frozen = list;
+  frozen[frozen_len++] = h;
+
+  copy_root = freeze_forward(h, root);
+  for (scan = (Block_Header *)(h + 1); (size_t)scan < h->current;
+       scan = NEXT_HEADER(scan)) {
+    if (FL_TEST(scan, FL_STRING | FL_NOSCAN))
+      continue;
+    for (field = (void **)(scan + 1); (size_t)field < BODY_END(scan); field++)
+      *field = freeze_forward(h, *field);
+    scan->flags &= ~(size_t)FL_EPHEMERON;
+  }
+  if (freeze_pinned()) {
+    freeze_undo(h);
+    return root;
+  }
+  mprotect(h, SPACE_MAP_SIZE(h->size), PROT_READ);
+
+  /* frozen keys cannot be traced back to their buckets, maps rehash */
+  gc_epoch++;
+  collect(0);
+
+  return copy_root;
+}
+
+/**
+ * @brief Tells whether ptr points into a frozen space.
+ *
+ * @param ptr A candidate pointer.
+ * @return true if ptr lies in a space populated by mini_cpgc_freeze.
+ */
+static bool is_frozen(void *ptr) {
+  size_t i;
+
+  for (i = 0; i < frozen_len; i++)
+    if (IN_HEAP(frozen[i], ptr))
+      return true;
+
+  return false;
+}
+
+/* ========================================================================== */
+/*  clone                                                                     */
+/* ========================================================================== */
+
+#define CLONE_FLAGS                                                            \
+  (FL_ALLOC | FL_EPHEMERON | FL_STRING | FL_NOSCAN |                          \
+   ~(((size_t)1 << FL_SITE_SHIFT) - 1))
+
+/**
+ * @struct Clone_Table
+ * @brief A forwarding table from the objects of a subgraph to their clones.
+ *
+ * The originals are kept out of the collector's forwarding state, which
+ * lives in their headers.
+ *
+ * @var Clone_Table::from
+ * The originals, in breadth-first order from the root.
+ *
+ * @var Clone_Table::to
+ * The clone of each original, once allocated.
+ *
+ * @var Clone_Table::slots
+ * An open-addressed index of from, holding i + 1 for from[i] and 0 when
+ * empty; slots_cap is a power of two.
+ *
+ * @var Clone_Table::bytes
+ * The room the clones take in From-space.
+ *
+ * @var Clone_Table::immortal
+ * Whether permanent and frozen objects are copied too, rather than shared.
+ */
+typedef struct clone_table {
+  Block_Header **from;
+  Block_Header **to;
+  size_t len;
+  size_t cap;
+  size_t *slots;
+  size_t slots_cap;
+  size_t bytes;
+  bool immortal;
+} Clone_Table;
+
+/**
+ * @brief Returns the block a pointer refers to, if a table would copy it.
+ */
+static Block_Header *clone_source(Clone_Table *t, void *ptr) {
+  Block_Header *p;
+  size_t i;
+
+  p = find_block(from_start, ptr);
+  if (p == NULL)
+    p = find_block(old_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+  if (p == NULL && t->immortal)
+    p = find_block(perm_start, ptr);
+  for (i = 0; p == NULL && t->immortal && i < frozen_len; i++)
+    p = find_block(frozen[i], ptr);
+
+  return p;
+}
+
+/**
+ * @brief Returns the slot of a block in the index of a table.
+ */
+static size_t *clone_slot(Clone_Table *t, Block_Header *p) {
+  size_t i = address_hash(p) & (t->slots_cap - 1);
+
+  while (t->slots[i] != 0 && t->from[t->slots[i] - 1] != p)
+    i = (i + 1) & (t->slots_cap - 1);
+
+  return &t->slots[i];
+}
+
+/**
+ * @brief Adds a block to a table unless it is already there.
+ *
+ * @return false if memory ran out.
+ */
+static bool clone_add(Clone_Table *t, Block_Header *p) {
+  Block_Header **from;
+  size_t *slots, cap, i;
+
+  if (t->len * 2 >= t->slots_cap) {
+    cap = t->slots_cap == 0 ? 64 : t->slots_cap * 2;
+    slots = calloc(cap, sizeof(*slots));
+    if (slots == NULL)
+      return false;
+    free(t->slots);
+    t->slots = slots;
+    t->slots_cap = cap;
+    for (i = 0; i < t->len; i++)
+      *clone_slot(t, t->from[i]) = i + 1;
+  }
+  slots = clone_slot(t, p);
+  if (*slots != 0)
+    return true;
+
+  if (t->len == t->cap) {
+    t->cap = t->cap == 0 ? 64 : t->cap * 2;
+    from = realloc(t->from, t->cap * sizeof(*t->from));
+    if (from == NULL)
+      return false;
+    t->from = from;
+  }
+  t->from[t->len++] = p;
+  *slots = t->len;
+  t->bytes += (size_t)BODY_END(p) - (size_t)p;
+
+  return true;
+}
+
+/**
+ * @brief Fills a table with the subgraph reachable from root.
+ *
+ * @return false if memory ran out.
+ */
+static bool clone_discover(Clone_Table *t, void *root) {
+  Block_Header *p, *q;
+  void **field;
+  size_t i;
+
+  t->len = 0;
+  t->bytes = 0;
+  if (t->slots != NULL)
+    memset(t->slots, 0, t->slots_cap * sizeof(*t->slots));
+  if (!clone_add(t, clone_source(t, root)))
+    return false;
+  for (i = 0; i < t->len; i++) {
+    p = t->from[i];
+    if (FL_TEST(p, FL_STRING | FL_NOSCAN))
+      continue;
+    for (field = (void **)(p + 1); (size_t)field < BODY_END(p); field++) {
+      q = clone_source(t, *field);
+      if (q != NULL && !clone_add(t, q))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * @brief Redirects a pointer into the subgraph to the matching clone.
+ */
+static void *clone_forward(Clone_Table *t, void *ptr) {
+  Block_Header *p;
+  size_t i;
+
+  p = clone_source(t, ptr);
+  if (p == NULL || (i = *clone_slot(t, p)) == 0)
+    return ptr;
+
+  return (void *)((size_t)t->to[i - 1] + ((size_t)ptr - (size_t)p));
+}
+
+/**
+ * @brief Copies the subgraph of a table into From-space.
+ *
+ * @param t The table, filled by clone_discover.
+ * @param root The root object, updated if a collection moves it.
+ * @return The copy of root, or NULL if memory ran out.
+ */
+static void *clone_build(Clone_Table *t, void **root) {
+  Block_Header *p, *q;
+  void **field;
+  size_t i, size;
+
+  if (!HEAP_FITS(from_start, t->bytes)) {
+    collect(t->bytes);
+    if (!HEAP_FITS(from_start, t->bytes))
+      collect(t->bytes);
+    /* the collection moved the subgraph */
+    if (!HEAP_FITS(from_start, t->bytes) || !clone_discover(t, *root))
+      return NULL;
+  }
+  t->to = malloc(t->len * sizeof(*t->to));
+  if (t->to == NULL)
+    return NULL;
+
+  for (i = 0; i < t->len; i++) {
+    p = t->from[i];
+    size = (size_t)BODY_END(p) - (size_t)(p + 1);
+    q = (Block_Header *)from_start->current;
+    memcpy(q + 1, p + 1, size);
+    q->flags = p->flags & CLONE_FLAGS;
+    q->size = size;
+    q->next_free = NULL;
+    start_span(from_start, q, size);
+    from_start->current = (size_t)NEXT_HEADER(q);
+    sites[FL_SITE(q)].pending++;
+    t->to[i] = q;
+  }
+  for (i = 0; i < t->len; i++) {
+    q = t->to[i];
+    if (FL_TEST(q, FL_STRING | FL_NOSCAN))
+      continue;
+    for (field = (void **)(q + 1); (size_t)field < BODY_END(q); field++)
+      *field = clone_forward(t, *field);
+  }
+
+  return clone_forward(t, *root);
+}
+
+/**
+ * @fn void *mini_cpgc_clone(void *root)
+ * @brief Deep copies the subgraph reachable from an object.
+ *
+ * Every object reachable from root, except permanent and frozen objects
+ * which the clone shares, is copied once into From-space, so sharing and
+ * cycles are preserved. The pointers of the copies are then redirected to
+ * the copies through a temporary forwarding table. The copies are new
+ * objects: their age is zero and they have no identity hash yet. A
+ * collection runs first if From-space is too small for the copies.
+ *
+ * @param root A pointer to the root object.
+ * @return The copy of root, root itself if it is not a heap object, or NULL
+ * if memory ran out.
+ */
+void *mini_cpgc_clone(void *root) {
+  Clone_Table t = {NULL, NULL, 0, 0, NULL, 0, 0, false};
+  void *copy_root = NULL;
+
+  if (clone_source(&t, root) == NULL)
+    return root;
+
+  mini_cpgc_add_root(&root);
+  if (clone_discover(&t, root))
+    copy_root = clone_build(&t, &root);
+  mini_cpgc_remove_root(&root);
+  free(t.from);
+  free(t.to);
+  free(t.slots);
+
+  return copy_root;
+}
+
+/* ========================================================================== */
+/*  serialization                                                             */
+/* ========================================================================== */
+
+/**
+ * @struct Serial_Header
+ * @brief The start of a buffer written by mini_cpgc_serialize.
+ *
+ * The objects follow, laid out as in the heap, then a bitmap with a bit set
+ * for every word of the objects that holds an offset to be relocated.
+ *
+ * @var Serial_Header::size
+ * The size of the whole image, in bytes.
+ *
+ * @var Serial_Header::objects
+ * The size of the objects, in bytes.
+ *
+ * @var Serial_Header::root
+ * The offset of the root pointer from the first object header.
+ */
+typedef struct serial_header {
+  char magic[8];
+  size_t size;
+  size_t objects;
+  size_t root;
+} Serial_Header;
+
+#define SERIAL_MAGIC "MCPGCSR1"
+#define SERIAL_MAP_SIZE(objects) (ALIGN((objects) / PTRSIZE, WORD_BITS) / 8)
+
+/**
+ * @brief Rewrites a pointer into the subgraph as an offset into the image.
+ *
+ * @param t The table, whose to entries point into the image.
+ * @param base The first object header of the image.
+ * @param field A word of an object in the image.
+ * @param map The relocation bitmap of the image.
+ */
+static void serial_relocate(Clone_Table *t, size_t base, void **field,
+                            size_t *map) {
+  Block_Header *p;
+  size_t i;
+
+  p = clone_source(t, *field);
+  if (p == NULL || (i = *clone_slot(t, p)) == 0)
+    return;
+
+  *field = (void *)((size_t)t->to[i - 1] - base + ((size_t)*field - (size_t)p));
+  i = ((size_t)field - base) / PTRSIZE;
+  map[i / WORD_BITS] |= (size_t)1 << (i % WORD_BITS);
+}
+
+/**
+ * @brief Lays out the subgraph of a table in an image.
+ *
+ * @param t The table, filled by clone_discover.
+ * @param root The root object.
+ * @param buf The buffer.
+ * @param len The size of the buffer in bytes.
+ * @return The size of the image, or zero if memory ran out.
+ */
+static size_t serial_write(Clone_Table *t, void *root, void *buf, size_t len) {
+  Serial_Header *h = buf;
+  Block_Header *p, *q;
+  void **field;
+  size_t base, size, *map, i;
+
+  size = sizeof(Serial_Header) + t->bytes + SERIAL_MAP_SIZE(t->bytes);
+  if (size > len)
+    return size;
+  t->to = malloc(t->len * sizeof(*t->to));
+  if (t->to == NULL)
+    return 0;
+
+  base = (size_t)(h + 1);
+  map = (size_t *)(base + t->bytes);
+  memset(map, 0, SERIAL_MAP_SIZE(t->bytes));
+  q = (Block_Header *)base;
+  for (i = 0; i < t->len; i++) {
+    p = t->from[i];
+    q->flags = p->flags & CLONE_FLAGS;
+    q->size = (size_t)BODY_END(p) - (size_t)(p + 1);
+    q->next_free = NULL;
+    memcpy(q + 1, p + 1, q->size);
+    t->to[i] = q;
+    q = NEXT_HEADER(q);
+  }
+  for (i = 0; i < t->len; i++) {
+    q = t->to[i];
+    if (FL_TEST(q, FL_STRING | FL_NOSCAN))
+      continue;
+    for (field = (void **)(q + 1); (size_t)field < BODY_END(q); field++)
+      serial_relocate(t, base, field, map);
+  }
+
+  memcpy(h->magic, SERIAL_MAGIC, sizeof(h->magic));
+  h->size = size;
+  h->objects = t->bytes;
+  p = clone_source(t, root);
+  h->root = (size_t)t->to[*clone_slot(t, p) - 1] - base +
+            ((size_t)root - (size_t)p);
+
+  return size;
+}
+
+/**
+ * @fn size_t mini_cpgc_serialize(void *root, void *buf, size_t len)
+ * @brief Writes the subgraph reachable from an object into a buffer.
+ *
+ * Every object reachable from root, permanent and frozen ones included, is
+ * laid out contiguously after a header, with the pointers between them
+ * replaced by offsets from the first object and flagged in a bitmap. The
+ * image holds no absolute address, so it can be copied anywhere, to a file
+ * or to shared memory, and read back with mini_cpgc_deserialize by a process
+ * with the same word size and byte order. The identity hashes and ages of
+ * the objects are not kept.
+ *
+ * @param root A pointer to the root object.
+ * @param buf The buffer, aligned for a pointer.
+ * @param len The size of the buffer in bytes.
+ * @return The size of the image. Nothing is written if it exceeds len. Zero
+ * if root is not a heap object or memory ran out.
+ */
+size_t mini_cpgc_serialize(void *root, void *buf, size_t len) {
+  Clone_Table t = {NULL, NULL, 0, 0, NULL, 0, 0, true};
+  size_t size = 0;
+
+  if (clone_source(&t, root) != NULL && clone_discover(&t, root))
+    size = serial_write(&t, root, buf, len);
+  free(t.from);
+  free(t.to);
+  free(t.slots);
+
+  return size;
+}
+
+/**
+ * @brief Checks the objects and the relocation bitmap of an image.
+ *
+ * Every block must fit in the image with a valid size and site, and an
+ * ephemeron must hold exactly a key and a value. Every flagged word must lie
+ * in a body and hold an offset into the image, and the root must point into
+ * a body, so that deserializing the image writes and returns nothing
+ * outside the copy.
+ *
+ * @param h The image, whose header is already checked.
+ * @return Whether the image is valid.
+ */
+static bool serial_check(const Serial_Header *h) {
+  const Block_Header *q;
+  const size_t *words = (const size_t *)(h + 1), *map;
+  size_t end, n = h->objects / PTRSIZE, i;
+  bool root = false;
+
+  end = (size_t)(h + 1) + h->objects;
+  map = (const size_t *)end;
+  if (n % WORD_BITS != 0 && map[n / WORD_BITS] >> (n % WORD_BITS) != 0)
+    return false;
+  for (q = (const Block_Header *)(h + 1); (size_t)q < end;
+       q = NEXT_HEADER(q)) {
+    if (end - (size_t)q < BLOCK_HEADER_SIZE ||
+        q->size > end - (size_t)(q + 1) || q->size % PTRSIZE != 0 ||
+        q->size == 0 || FL_SITE(q) >= MINI_CPGC_MAX_SITES ||
+        (FL_TEST(q, FL_EPHEMERON) && q->size != 2 * PTRSIZE))
+      return false;
+    if (h->root >= (size_t)(q + 1) - (size_t)(h + 1) &&
+        h->root < (size_t)NEXT_HEADER(q) - (size_t)(h + 1))
+      root = true;
+    for (i = (size_t)((const size_t *)q - words);
+         i < (size_t)((const size_t *)NEXT_HEADER(q) - words); i++)
+      if ((map[i / WORD_BITS] >> (i % WORD_BITS) & 1) != 0 &&
+          (&words[i] < (const size_t *)(q + 1) || words[i] >= h->objects))
+        return false;
+  }
+
+  return root;
+}
+
+/**
+ * @fn void *mini_cpgc_deserialize(const void *buf, size_t len)
+ * @brief Reads back a subgraph written by mini_cpgc_serialize.
+ *
+ * The objects are copied into From-space at once, then a single pass over
+ * the relocation bitmap turns the offsets back into pointers. A collection
+ * runs first if From-space is too small.
+ *
+ * @param buf The image, aligned for a pointer.
+ * @param len The size of the image in bytes.
+ * @return The copy of the root object, or NULL if the image is invalid or
+ * memory ran out.
+ */
+void *mini_cpgc_deserialize(const void *buf, size_t len) {
+  const Serial_Header *h = buf;
+  const size_t *map;
+  Block_Header *p;
+  size_t base, end, word, i;
+
+  if (len < sizeof(*h) || memcmp(h->magic, SERIAL_MAGIC, 8) != 0 ||
+      h->size > len || h->objects > len - sizeof(*h) ||
+      SERIAL_MAP_SIZE(h->objects) > len - sizeof(*h) - h->objects ||
+      h->objects % PTRSIZE != 0 || h->root >= h->objects ||
+      h->size != sizeof(*h) + h->objects + SERIAL_MAP_SIZE(h->objects) ||
+      !serial_check(h))
+    return NULL;
+  if (!HEAP_FITS(from_start, h->objects)) {
+    collect(h->objects);
+    if (!HEAP_FITS(from_start, h->objects))
+      collect(h->objects);
+    if (!HEAP_FITS(from_start, h->objects))
+      return NULL;
+  }
+
+  base = from_start->current;
+  end = base + h->objects;
+  memcpy((void *)base, h + 1, h->objects);
+  for (p = (Block_Header *)base; (size_t)p < end; p = NEXT_HEADER(p)) {
+    p->flags = (p->flags & CLONE_FLAGS) | FL_ALLOC;
+    start_span(from_start, p, p->size);
+    sites[FL_SITE(p)].pending++;
+  }
+  from_start->current = end;
+
+  map = (const size_t *)((size_t)(h + 1) + h->objects);
+  for (i = 0; i < h->objects / PTRSIZE; i += WORD_BITS) {
+    for (word = map[i / WORD_BITS]; word != 0; word &= word - 1)
+      *((size_t *)base + i + (size_t)__builtin_ctzl(word)) += base;
+  }
+
+  return (void *)(base + h->root);
+}
+
+/* ========================================================================== */
+/*  heap instances                                                            */
+/* ========================================================================== */
+
+/*
+ * The state of a heap; the collector works on the globals, which hold the
+ * state of the current heap. The settings enabled by the mini_cpgc_set_*
+ * functions, the soft limit and the scratch tables of a collection are
+ * shared by all heaps.
+ */
+#define HEAP_STATE(X)                                                          \
+  X(from_start)                                                                \
+  X(to_start)                                                                  \
+  X(old_start)                                                                 \
+  X(perm_start)                                                                \
+  X(buddy_start)                                                               \
+  X(roots)                                                                     \
+  X(roots_len)                                                                 \
+  X(roots_cap)                                                                 \
+  X(age_histogram)                                                             \
+  X(type_histogram)                                                            \
+  X(size_class_histogram)                                                      \
+  X(leaked)                                                                    \
+  X(freed_reachable)                                                           \
+  X(sites)                                                                     \
+  X(old_free)                                                                  \
+  X(hash_pending)                                                              \
+  X(gc_epoch)                                                                  \
+  X(maps)                                                                      \
+  X(frozen)                                                                    \
+  X(frozen_len)                                                                \
+  X(free_fl_map)                                                               \
+  X(free_sl_map)                                                               \
+  X(free_lists)                                                                \
+  X(buddy_orders)                                                              \
+  X(buddy_lists)                                                               \
+  X(buddy_maps)
+
+#define HEAP_FIELD(v) __typeof__(v) v;
+#define HEAP_SAVE(v) memcpy(&current_heap->v, &v, sizeof(v));
+#define HEAP_LOAD(v) memcpy(&v, &current_heap->v, sizeof(v));
+
+/**
+ * @struct mini_cpgc_heap
+ * @brief An independent heap, with its own spaces, roots and statistics.
+ */
+struct mini_cpgc_heap {
+  HEAP_STATE(HEAP_FIELD)
+};
+
+static Mini_Cpgc_Heap default_heap;
+static Mini_Cpgc_Heap *current_heap = &default_heap;
+
+/**
+ * @fn Mini_Cpgc_Heap *mini_cpgc_heap_current(void)
+ * @brief Returns the heap the allocator and the collector work on.
+ *
+ * @return The current heap; the default heap until another is switched to.
+ */
+Mini_Cpgc_Heap *mini_cpgc_heap_current(void) { return current_heap; }
+
+/**
+ * @fn Mini_Cpgc_Heap *mini_cpgc_heap_switch(Mini_Cpgc_Heap *heap)
+ * @brief Makes a heap current.
+ *
+ * Every other function of the collector then works on that heap. A heap must
+ * only be used by one thread at a time.
+ *
+ * @param heap The heap.
+ * @return The heap that was current.
+ */
+Mini_Cpgc_Heap *mini_cpgc_heap_switch(Mini_Cpgc_Heap *heap) {
+  Mini_Cpgc_Heap *prev = current_heap;
+
+  if (heap != current_heap) {
+    compact_finish();
+    HEAP_STATE(HEAP_SAVE)
+    current_heap = heap;
+    HEAP_STATE(HEAP_LOAD)
+  }
+
+  return prev;
+}
+
+/**
+ * @fn Mini_Cpgc_Heap *mini_cpgc_heap_new(size_t size)
+ * @brief Creates a heap, as heap_init would initialize it.
+ *
+ * @param size The requested size of its spaces in bytes.
+ * @return The heap, or NULL if memory ran out.
+ */
+Mini_Cpgc_Heap *mini_cpgc_heap_new(size_t size) {
+  Mini_Cpgc_Heap *heap, *prev;
+
+  heap = calloc(1, sizeof(*heap));
+  if (heap == NULL)
+    return NULL;
+
+  prev = mini_cpgc_heap_switch(heap);
+  heap_init(size);
+  mini_cpgc_heap_switch(prev);
+
+  return heap;
+}
+
+/**
+ * @fn void mini_cpgc_heap_delete(Mini_Cpgc_Heap *heap)
+ * @brief Releases a heap created by mini_cpgc_heap_new, and its objects.
+ *
+ * @param heap The heap, which must not be current.
+ */
+void mini_cpgc_heap_delete(Mini_Cpgc_Heap *heap) {
+  Mini_Cpgc_Heap *prev;
+
+  if (heap == NULL || heap == current_heap || heap == &default_heap)
+    return;
+
+  mark_cancel(heap);
+  prev = mini_cpgc_heap_switch(heap);
+  space_free(from_start);
+  space_free(to_start);
+  space_free(old_start);
+  space_free(perm_start);
+  while (frozen_len > 0)
+    space_free(frozen[--frozen_len]);
+  free(frozen);
+  buddy_destroy();
+  free(roots);
+  mini_cpgc_heap_switch(prev);
+  free(heap);
+}
+
+/**
+ * @brief Copies an object of the current heap into another heap's space.
+ *
+ * The original is copied unless done already. Its forwarding is kept in the
+ * table, as for a clone, since permanent and frozen originals cannot be
+ * written to.
+ *
+ * @param t The table, filled by clone_discover.
+ * @param to The space of the destination heap.
+ * @param ptr A candidate pointer.
+ * @return The forwarded pointer.
+ */
+static void *transfer_forward(Clone_Table *t, Heap_Header *to, void *ptr) {
+  Block_Header *p;
+  size_t i;
+
+  p = clone_source(t, ptr);
+  if (p == NULL || (i = *clone_slot(t, p)) == 0)
+    return ptr;
+  if (t->to[i - 1] == NULL)
+    t->to[i - 1] = duplicate(p, to);
+
+  return (void *)((size_t)t->to[i - 1] + ((size_t)ptr - (size_t)p));
+}
+
+/**
+ * @fn void *mini_cpgc_transfer(Mini_Cpgc_Heap *, Mini_Cpgc_Heap *, void *)
+ * @brief Copies the subgraph reachable from an object into another heap.
+ *
+ * The objects of src reachable from root, permanent and frozen ones
+ * included, are copied into the From-space of dst in Cheney order, with the
+ * forwarding kept in a table as for mini_cpgc_clone, so sharing and cycles
+ * are preserved, the identity hashes carried over and src left as it was:
+ * the two heaps share nothing afterwards. A collection of dst runs first if
+ * it is too small for the subgraph.
+ *
+ * @param src The heap root belongs to.
+ * @param dst The heap to copy to.
+ * @param root A pointer to the root object.
+ * @return The copy of root in dst, root itself if it is not an object of
+ * src, or NULL if memory ran out.
+ */
+void *mini_cpgc_transfer(Mini_Cpgc_Heap *src, Mini_Cpgc_Heap *dst,
+                         void *root) {
+  Clone_Table t = {NULL, NULL, 0, 0, NULL, 0, 0, true};
+  Mini_Cpgc_Heap *prev;
+  Heap_Header *to = NULL;
+  Block_Header *start, *scan;
+  void **field, *copy_root = root;
+  size_t i, need = 0;
+
+  prev = mini_cpgc_heap_switch(src);
+  if (src != dst && clone_source(&t, root) != NULL) {
+    copy_root = NULL;
+    if (clone_discover(&t, root))
+      t.to = calloc(t.len, sizeof(*t.to));
+    for (i = 0; t.to != NULL && i < t.len; i++)
+      need += BLOCK_HEADER_SIZE + t.from[i]->size +
+              (FL_TEST(t.from[i], FL_HASHED | FL_HASH_SLOT) == FL_HASHED
+                   ? PTRSIZE
+                   : 0);
+  }
+
+  if (t.to != NULL) {
+    mini_cpgc_heap_switch(dst);
+    if (!HEAP_FITS(from_start, need))
+      collect(need);
+    if (!HEAP_FITS(from_start, need))
+      collect(need);
+    if (HEAP_FITS(from_start, need))
+      to = from_start;
+    mini_cpgc_heap_switch(src);
+  }
+
+  if (to != NULL) {
+    start = (Block_Header *)to->current;
+    copy_root = transfer_forward(&t, to, root);
+    for (scan = start; (size_t)scan < to->current; scan = NEXT_HEADER(scan)) {
+      if (FL_TEST(scan, FL_STRING | FL_NOSCAN))
+        continue;
+      for (field = (void **)(scan + 1); (size_t)field < BODY_END(scan);
+           field++)
+        *field = transfer_forward(&t, to, *field);
+    }
+
+    /* the copies start life as new objects of dst */
+    mini_cpgc_heap_switch(dst);
+    for (scan = start; (size_t)scan < to->current; scan = NEXT_HEADER(scan)) {
+      scan->flags &= ~(size_t)(FL_AGE_MASK | FL_MARK);
+      scan->next_free = NULL;
+      sites[FL_SITE(scan)].pending++;
+    }
+  }
+
+  mini_cpgc_heap_switch(prev);
+  free(t.from);
+  free(t.to);
+  free(t.slots);
+
+  return copy_root;
+}
+
+/* ========================================================================== */
+/*  copying                                                                   */
+/* ========================================================================== */
+
+/**
+ * @brief Swap the "from" and "to" heaps.
+ *
+ * This function swaps the pointers for the "from" and "to" heaps,
+ * effectively making the "to" heap the new "from" heap for the next
+ * garbage collection cycle, and advances the epoch seen by the maps.
+ */
+void swap() {
+  Heap_Header *tmp;
+
+  tmp = from_start;
+  from_start = to_start;
+  to_start = tmp;
+
+  free_reset();
+  gc_epoch++;
+}
+
+/**
+ * @brief Evacuates the live objects and resizes the semispaces.
+ *
+ * Objects reachable from the roots, the maps, the global variables if enabled
+ * and the permanent space are copied to To-space in Cheney order, and reachable
+ * old objects are marked in place. Ephemerons are then resolved to a fixed
+ * point and those with dead keys cleared, the leak check reports if enabled,
+ * the rest of the old space is swept, the heaps are swapped, and the now empty
+ * To-space is resized to fit the live data plus req_size under the soft limit.
+ * A shrink is applied to the From-space at once by lowering its end. To-space
+ * is moved to the NUMA node of the collecting thread first, so the survivors
+ * end up node-local to the thread that allocates after the collection.
+ * A minor collection takes every old and buddy object as live: instead of
+ * tracing them, it scans those on dirty pages as roots, and sweeps nothing.
+ * When global variables pin From-space blocks, the other survivors are
+ * promoted to the old space and From-space is kept instead of swapped.
+ *
+ * @param req_size The allocation that triggered the collection, or zero.
+ */
+static void collect(size_t req_size) {
+  Block_Header *scan;
+  size_t i, size;
+
+  compact_finish();
+  if (HEAP_CAPACITY(to_start) < HEAP_USED(from_start) + hash_pending * PTRSIZE)
+    space_resize(&to_start, HEAP_USED(from_start) + hash_pending * PTRSIZE);
+  hash_pending = 0;
+  numa_bind(to_start, numa_current_node());
+  to_start->current = (size_t)(to_start + 1);
+  start_reset(to_start);
+  memset(age_histogram, 0, sizeof(age_histogram));
+  if (type_histogram_enabled) {
+    memset(type_histogram, 0, sizeof(type_histogram));
+    memset(size_class_histogram, 0, sizeof(size_class_histogram));
+  }
+  if (leak_check_fp != NULL) {
+    memset(leaked, 0, sizeof(leaked));
+    memset(freed_reachable, 0, sizeof(freed_reachable));
+  }
+  dedup_reset();
+  wp_begin();
+
+  /* pins are known before the roots move anything */
+  pinning = scan_data_segments();
+  for (i = 0; i < roots_len; i++)
+    *roots[i] = forward(*roots[i]);
+  map_forward_all();
+  scan_permanent();
+  wp_scan_dirty();
+  scan = (Block_Header *)(to_start + 1);
+  trace(&scan);
+  while (ephemeron_step())
+    trace(&scan);
+  ephemeron_clear();
+  if (leak_check_fp != NULL) {
+    leak_check_dead();
+    leak_check_report();
+  }
+  if (!minor_collection) {
+    sweep_old();
+    sweep_buddy();
+  }
+
+  if (pinning) {
+    pin_sweep();
+    /* promoted keys cannot be traced back to their buckets, maps rehash */
+    gc_epoch += 2;
+    pinning = false;
+  } else {
+    swap();
+  }
+  site_update();
+  wp_protect();
+
+  size = space_target_size(HEAP_USED(from_start) + BLOCK_HEADER_SIZE +
+                           req_size);
+  if (to_start->size != size)
+    space_resize(&to_start, size);
+  if (HEAP_CAPACITY(from_start) > size)
+    from_start->end = (size_t)(from_start + 1) + size;
+}
+
+/**
+ * @fn const size_t *mini_cpgc_age_histogram(void)
+ * @brief Returns the survivors of the last collection by age.
+ *
+ * Element i holds the bytes, headers included, of the objects that have
+ * survived i collections; the last element also counts older objects.
+ *
+ * @return An array of MINI_CPGC_AGE_MAX + 1 byte counts.
+ */
+const size_t *mini_cpgc_age_histogram(void) { return age_histogram; }
+
+/**
+ * @brief Perform the copying garbage collection.
+ *
+ * This function copies the blocks reachable from the roots in the "from"
+ * heap to the "to" heap, and then swaps the heaps.
+ */
+void copying(void) { collect(0); }
+
+/* ========================================================================== */
+/*  heap snapshot                                                             */
+/* ========================================================================== */
+
+/**
+ * @struct Snapshot
+ * @brief The state of mini_cpgc_write_snapshot.
+ *
+ * @var Snapshot::nodes
+ * Every allocated block, sorted by address; node i + 1 of the file is
+ * nodes[i], node 0 being the synthetic root.
+ *
+ * @var Snapshot::edges
+ * The outgoing edges of the node being written.
+ */
+typedef struct snapshot {
+  FILE *fp;
+  Block_Header **nodes;
+  size_t len;
+  size_t cap;
+  uint32_t *edges;
+  size_t edges_len;
+  size_t edges_cap;
+} Snapshot;
+
+/**
+ * @brief Appends the allocated blocks of a space to the node list.
+ *
+ * @param s The snapshot.
+ * @param h The space.
+ * @return false if memory ran out.
+ */
+static bool snapshot_add_space(Snapshot *s, Heap_Header *h) {
+  Block_Header *p, **nodes;
+
+  for (p = (Block_Header *)(h + 1); (size_t)p < h->current;
+       p = NEXT_HEADER(p)) {
+    if (!FL_TEST(p, FL_ALLOC))
+      continue;
+    if (s->len == s->cap) {
+      s->cap = s->cap == 0 ? 256 : s->cap * 2;
+      nodes = realloc(s->nodes, s->cap * sizeof(*s->nodes));
+      if (nodes == NULL)
+        return false;
+      s->nodes = nodes;
+    }
+    s->nodes[s->len++] = p;
+  }
+
+  return true;
+}
+
+/**
+ * @brief qsort and bsearch comparator ordering blocks by address.
+ */
+static int snapshot_cmp(const void *a, const void *b) {
+  size_t x = (size_t)*(Block_Header *const *)a;
+  size_t y = (size_t)*(Block_Header *const *)b;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * @brief Records an edge to the object ptr points to, if any.
+ *
+ * @param s The snapshot.
+ * @param ptr A candidate pointer.
+ * @return false if memory ran out.
+ */
+static bool snapshot_edge(Snapshot *s, void *ptr) {
+  Block_Header *p, **found;
+  uint32_t *edges;
+  size_t i;
+
+  p = find_block(from_start, ptr);
+  if (p == NULL)
+    p = find_block(old_start, ptr);
+  if (p == NULL)
+    p = find_block(perm_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+  for (i = 0; p == NULL && i < frozen_len; i++)
+    p = find_block(frozen[i], ptr);
+  if (p == NULL)
+    return true;
+  found = bsearch(&p, s->nodes, s->len, sizeof(*s->nodes), snapshot_cmp);
+  if (found == NULL)
+    return true;
+
+  if (s->edges_len == s->edges_cap) {
+    s->edges_cap = s->edges_cap == 0 ? 64 : s->edges_cap * 2;
+    edges = realloc(s->edges, s->edges_cap * sizeof(*s->edges));
+    if (edges == NULL)
+      return false;
+    s->edges = edges;
+  }
+  s->edges[s->edges_len++] = (uint32_t)(found - s->nodes + 1);
+
+  return true;
+}
+
+/**
+ * @brief Records the edges held in global variables.
+ *
+ * @param s The snapshot.
+ * @return false if memory ran out.
+ */
+__attribute__((no_sanitize_address)) static bool
+snapshot_data_segments(Snapshot *s) {
+  void **field;
+  size_t i;
+
+  if (!data_scan_enabled)
+    return true;
+  data_refresh();
+  for (i = 0; i < data_ranges_len; i++)
+    for (field = data_ranges[i].start; field + 1 <= data_ranges[i].end;
+         field++)
+      if (!snapshot_edge(s, *field))
+        return false;
+
+  return true;
+}
+
+/**
+ * @brief Records the edges from the roots of the collector.
+ *
+ * The permanent and frozen objects are never collected, so they are all
+ * roots too.
+ *
+ * @param s The snapshot.
+ * @return false if memory ran out.
+ */
+static bool snapshot_roots(Snapshot *s) {
+  Mini_Cpgc_Map *map;
+  Map_Table *t;
+  Map_Entry *e;
+  size_t i, j;
+
+  for (i = 0; i < roots_len; i++)
+    if (!snapshot_edge(s, *roots[i]))
+      return false;
+  for (map = maps; map != NULL; map = map->next) {
+    for (t = &map->cur; t != NULL; t = t == &map->cur ? &map->stale : NULL)
+      for (j = 0; j < t->cap; j++)
+        for (e = t->buckets[j]; e != NULL; e = e->next)
+          if (!snapshot_edge(s, e->key) || !snapshot_edge(s, e->value))
+            return false;
+  }
+  for (i = 0; i < s->len; i++)
+    if ((IN_HEAP(perm_start, s->nodes[i]) || is_frozen(s->nodes[i])) &&
+        !snapshot_edge(s, s->nodes[i] + 1))
+      return false;
+
+  return snapshot_data_segments(s);
+}
+
+/**
+ * @brief Writes a node record and the edges collected for it.
+ *
+ * @param s The snapshot.
+ * @param address The address of the object body, zero for the root.
+ * @param size The size of the object, header included.
+ * @param type The allocation site of the object.
+ * @return false if the write failed.
+ */
+static bool snapshot_write_node(Snapshot *s, uint64_t address, uint64_t size,
+                                uint32_t type) {
+  uint32_t degree = (uint32_t)s->edges_len;
+
+  s->edges_len = 0;
+
+  return fwrite(&address, sizeof(address), 1, s->fp) == 1 &&
+         fwrite(&size, sizeof(size), 1, s->fp) == 1 &&
+         fwrite(&type, sizeof(type), 1, s->fp) == 1 &&
+         fwrite(&degree, sizeof(degree), 1, s->fp) == 1 &&
+         fwrite(s->edges, sizeof(*s->edges), degree, s->fp) == degree;
+}
+
+/**
+ * @fn int mini_cpgc_write_snapshot(FILE *fp)
+ * @brief Writes every live object and its references to a stream.
+ *
+ * A collection runs first, so that only live objects remain. The snapshot
+ * starts with MINI_CPGC_SNAPSHOT_MAGIC and a 64-bit node count. Each node
+ * follows as its 64-bit body address and size, header included, its 32-bit
+ * allocation site and out-degree, and the 32-bit indices of the nodes it
+ * points to. Node 0 is a synthetic root pointing to the registered roots,
+ * the maps, the global variables if scanned, and the permanent and frozen
+ * objects. Ephemerons are written with both fields as plain edges. All
+ * fields are in host byte order.
+ *
+ * @param fp The stream to write to.
+ * @return Non-zero on success, zero if memory ran out or the write failed.
+ */
+int mini_cpgc_write_snapshot(FILE *fp) {
+  Snapshot s = {fp, NULL, 0, 0, NULL, 0, 0};
+  Block_Header *p;
+  void **field;
+  uint64_t count;
+  size_t i;
+  bool ok;
+
+  collect(0);
+  ok = snapshot_add_space(&s, from_start) &&
+       snapshot_add_space(&s, old_start) &&
+       snapshot_add_space(&s, perm_start) &&
+       (buddy_start == NULL || snapshot_add_space(&s, buddy_start));
+  for (i = 0; ok && i < frozen_len; i++)
+    ok = snapshot_add_space(&s, frozen[i]);
+  if (ok)
+    qsort(s.nodes, s.len, sizeof(*s.nodes), snapshot_cmp);
+
+  count = s.len + 1;
+  ok = ok && fwrite(MINI_CPGC_SNAPSHOT_MAGIC, 8, 1, fp) == 1 &&
+       fwrite(&count, sizeof(count), 1, fp) == 1 && snapshot_roots(&s) &&
+       snapshot_write_node(&s, 0, 0, MINI_CPGC_NO_SITE);
+  for (i = 0; ok && i < s.len; i++) {
+    p = s.nodes[i];
+    if (!FL_TEST(p, FL_STRING | FL_NOSCAN))
+      for (field = (void **)(p + 1); ok && (size_t)field < BODY_END(p);
+           field++)
+        ok = snapshot_edge(&s, *field);
+    ok = ok && snapshot_write_node(&s, (uint64_t)(size_t)(p + 1),
+                                   BLOCK_HEADER_SIZE + p->size,
+                                   (uint32_t)FL_SITE(p));
+  }
+
+  free(s.nodes);
+  free(s.edges);
+
+  return ok;
+}
+
+/* ========================================================================== */
+/*  concurrent mark                                                           */
+/* ========================================================================== */
+
+/*
+ * A concurrent mark traces a copy-on-write snapshot of the heap in a forked
+ * child, which sets a bit in mark_map, shared with the parent, for each
+ * From-space and old block allocated at the fork and not reachable. Garbage
+ * stays garbage, and blocks allocated after the fork lie above mark_from_end
+ * and mark_old_end, since no freed block is reused meanwhile; the map is
+ * stale once a collection moved the objects, which mark_epoch detects.
+ */
+static size_t *mark_map;
+static size_t *mark_old_map;
+static size_t mark_map_size;
+static size_t mark_epoch;
+static Mini_Cpgc_Heap *mark_heap;
+static size_t mark_from_end;
+static size_t mark_old_end;
+
+/**
+ * @brief Marks the object ptr points to and pushes it on the mark stack.
+ *
+ * From-space blocks are marked too; the child of a concurrent mark throws
+ * its copy of the heap away, and mini_cpgc_compact turns the marks into
+ * forwarding pointers.
+ *
+ * @param ptr A candidate pointer.
+ */
+static void mark_snapshot(void *ptr) {
+  Block_Header *p;
+
+  p = find_block(from_start, ptr);
+  if (p == NULL)
+    p = find_block(old_start, ptr);
+  if (p == NULL && buddy_start != NULL)
+    p = find_block(buddy_start, ptr);
+  if (p == NULL || FL_TEST(p, FL_MARK))
+    return;
+  p->flags |= FL_MARK;
+  mark_push(p);
+}
+
+/**
+ * @brief Marks the objects a block points to.
+ *
+ * Ephemerons are scanned as plain objects: keeping a dead value until the
+ * next collection is safe.
+ *
+ * @param p The block to scan.
+ */
+static void mark_block(Block_Header *p) {
+  void **field;
+
+  if (FL_TEST(p, FL_STRING | FL_NOSCAN))
+    return;
+  for (field = (void **)(p + 1); (size_t)field < BODY_END(p); field++)
+    mark_snapshot(*field);
+}
+
+/**
+ * @brief Marks the objects referenced from global variables.
+ *
+ * The segment list is not refreshed: the child of a concurrent mark may not
+ * call the allocator, so the caller brings it up to date first.
+ */
+__attribute__((no_sanitize_address)) static void mark_data_segments(void) {
+  void **field;
+  size_t i;
+
+  if (!data_scan_enabled)
+    return;
+  for (i = 0; i < data_ranges_len; i++)
+    for (field = data_ranges[i].start; field + 1 <= data_ranges[i].end;
+         field++)
+      mark_snapshot(*field);
+}
+
+/**
+ * @brief Marks the objects reachable from the roots of the collector.
+ *
+ * The roots are those of collect; frozen objects are scanned too, as
+ * mini_cpgc_write_snapshot does.
+ */
+static void mark_trace(void) {
+  Mini_Cpgc_Map *map;
+  Map_Table *t;
+  Map_Entry *e;
+  Block_Header *p;
+  size_t i, j;
+
+  for (i = 0; i < roots_len; i++)
+    mark_snapshot(*roots[i]);
+  for (map = maps; map != NULL; map = map->next) {
+    for (t = &map->cur; t != NULL; t = t == &map->cur ? &map->stale : NULL)
+      for (j = 0; j < t->cap; j++)
+        for (e = t->buckets[j]; e != NULL; e = e->next) {
+          mark_snapshot(e->key);
+          mark_snapshot(e->value);
+        }
+  }
+  mark_data_segments();
+  for (p = (Block_Header *)(perm_start + 1); (size_t)p < perm_start->current;
+       p = NEXT_HEADER(p))
+    mark_block(p);
+  for (i = 0; i < frozen_len; i++)
+    for (p = (Block_Header *)(frozen[i] + 1); (size_t)p < frozen[i]->current;
+         p = NEXT_HEADER(p))
+      mark_block(p);
+
+  for (;;) {
+    while (mark_len > 0)
+      mark_block(mark_stack[--mark_len]);
+    if (!mark_overflow)
+      break;
+    mark_overflow = false;
+    mark_rescan(from_start, mark_block);
+    mark_rescan(old_start, mark_block);
+    if (buddy_start != NULL)
+      mark_rescan(buddy_start, mark_block);
+  }
+}
+
+/**
+ * @brief Sets the bit of every allocated block of a space left unmarked.
+ *
+ * @param h The space.
+ * @param map Its part of mark_map.
+ */
+static void mark_dead(Heap_Header *h, size_t *map) {
+  Block_Header *p;
+  size_t bit;
+
+  for (p = (Block_Header *)(h + 1); (size_t)p < h->current;
+       p = NEXT_HEADER(p)) {
+    if (!FL_TEST(p, FL_ALLOC) || FL_TEST(p, FL_MARK))
+      continue;
+    bit = START_BIT(h, p);
+    map[bit / WORD_BITS] |= (size_t)1 << (bit % WORD_BITS);
+  }
+}
+
+/**
+ * @brief Tells whether the child found a block dead.
+ *
+ * @param h The space of the block.
+ * @param map Its part of mark_map.
+ * @param p An allocated block below the end of the space at the fork.
+ */
+static bool mark_is_dead(Heap_Header *h, size_t *map, Block_Header *p) {
+  size_t bit = START_BIT(h, p);
+
+  return (map[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+/**
+ * @fn int mini_cpgc_concurrent_mark_start(void)
+ * @brief Starts marking the current heap in a forked child.
+ *
+ * The child traces a copy-on-write snapshot of the heap while the program
+ * goes on; the fork is the only pause. mini_cpgc_concurrent_mark_finish
+ * then frees what the child found dead. Until then, freed blocks are not
+ * reused.
+ *
+ * @return Non-zero if the mark started, zero if one is already running or
+ * the shared map or the child could not be created.
+ */
+int mini_cpgc_concurrent_mark_start(void) {
+  size_t from_size;
+  pid_t pid;
+
+  if (mark_pid != 0)
+    return 0;
+
+  from_size = START_MAP_SIZE(HEAP_CAPACITY(from_start));
+  mark_map_size = from_size + START_MAP_SIZE(HEAP_CAPACITY(old_start));
+  mark_map = mmap(NULL, mark_map_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mark_map == MAP_FAILED) {
+    mark_map = NULL;
+    return 0;
+  }
+  mark_old_map = mark_map + from_size / PTRSIZE;
+
+  if (data_scan_enabled)
+    data_refresh();
+  fflush(NULL);
+  pid = fork();
+  if (pid == 0) {
+    mark_trace();
+    mark_dead(from_start, mark_map);
+    mark_dead(old_start, mark_old_map);
+    _exit(EXIT_SUCCESS);
+  }
+  if (pid < 0) {
+    munmap(mark_map, mark_map_size);
+    mark_map = NULL;
+    return 0;
+  }
+
+  mark_pid = pid;
+  mark_epoch = gc_epoch;
+  mark_heap = mini_cpgc_heap_current();
+  mark_from_end = from_start->current;
+  mark_old_end = old_start->current;
+
+  return 1;
+}
+
+/**
+ * @brief Discards the concurrent mark of a heap, if one is running.
+ *
+ * The child is killed and reaped, since its map no longer matches the heap
+ * once the spaces are released.
+ *
+ * @param heap The heap whose spaces are about to be released.
+ */
+static void mark_cancel(Mini_Cpgc_Heap *heap) {
+  if (mark_pid == 0 || mark_heap != heap)
+    return;
+  kill(mark_pid, SIGKILL);
+  while (waitpid(mark_pid, NULL, 0) < 0 && errno == EINTR)
+    ;
+  mark_pid = 0;
+  munmap(mark_map, mark_map_size);
+  mark_map = NULL;
+}
+
+/**
+ * @brief Frees the blocks the child found dead.
+ *
+ * From-space blocks go back to the free lists, merged with their neighbours;
+ * the old space is swept with every other allocated block marked, so dead
+ * runs are merged and reused at once.
+ *
+ * @return The number of blocks freed.
+ */
+static size_t mark_reclaim(void) {
+  Block_Header *p, *next;
+  size_t count = 0;
+
+  for (p = (Block_Header *)(from_start + 1); (size_t)p < mark_from_end;
+       p = next) {
+    /* a free neighbour merged into p keeps its header, so it is skipped */
+    next = NEXT_HEADER(p);
+    if (FL_TEST(p, FL_ALLOC) && mark_is_dead(from_start, mark_map, p)) {
+      mini_cpgc_free(p + 1);
+      count++;
+    }
+  }
+
+  for (p = (Block_Header *)(old_start + 1); (size_t)p < old_start->current;
+       p = NEXT_HEADER(p)) {
+    if (!FL_TEST(p, FL_ALLOC))
+      continue;
+    if ((size_t)p < mark_old_end && mark_is_dead(old_start, mark_old_map, p)) {
+      p->flags = FL_FREE;
+      count++;
+    } else {
+      p->flags |= FL_MARK;
+    }
+  }
+  sweep_old();
+
+  return count;
+}
+
+/**
+ * @fn int mini_cpgc_concurrent_mark_finish(int wait)
+ * @brief Frees the objects found dead by a concurrent mark.
+ *
+ * Objects that died after the mark started are left to the next collection.
+ * The result is discarded if a collection has moved the objects since, if
+ * another heap is current, or during a leak check, whose next collection
+ * reports the dead objects instead.
+ *
+ * @param wait Non-zero to wait for the child to finish.
+ * @return The number of objects freed, zero if none was or the mark was
+ * discarded, or -1 if no mark is running or, without wait, it has not
+ * finished yet.
+ */
+long mini_cpgc_concurrent_mark_finish(int wait) {
+  long count = 0;
+  int status;
+  pid_t pid;
+
+  if (mark_pid == 0)
+    return -1;
+  do
+    pid = waitpid(mark_pid, &status, wait ? 0 : WNOHANG);
+  while (pid < 0 && errno == EINTR);
+  if (pid == 0)
+    return -1;
+
+  mark_pid = 0;
+  if (pid > 0 && WIFEXITED(status) &&
+      WEXITSTATUS(status) == EXIT_SUCCESS && mark_epoch == gc_epoch &&
+      mark_heap == mini_cpgc_heap_current() && leak_check_fp == NULL)
+    count = (long)mark_reclaim();
+  munmap(mark_map, mark_map_size);
+  mark_map = NULL;
+
+  return count;
+}
+
+/* ========================================================================== */
+/*  lazy compaction                                                           */
+/* ========================================================================== */
+
+/*
+ * mini_cpgc_compact marks the live objects in place, assigns each live
+ * From-space block its To-space address in address order, and flips the
+ * roots, the old objects and the permanent space to those addresses without
+ * copying anything. To-space pages are then protected, and the first access
+ * to one faults into compact_fill, which copies the objects overlapping the
+ * page from compact_moves, the forwarding table, and forwards their fields.
+ * The evacuated space stays untouched until every page is populated.
+ */
+static Heap_Header *compact_src;
+static Heap_Header *compact_dst;
+static size_t compact_end;
+static Block_Header **compact_moves;
+static size_t compact_len;
+static size_t *compact_filled;
+static size_t compact_pages;
+static size_t compact_left;
+
+#define COMPACT_FILLED(i)                                                      \
+  ((compact_filled[(i) / WORD_BITS] >> ((i) % WORD_BITS)) & 1)
+
+/**
+ * @brief Builds the header of the To-space copy of a block.
+ *
+ * The copy gets the identity hash slot the block needs, if any, one more
+ * collection of age, and points back to the block like after evacuate.
+ *
+ * @param src The live From-space block.
+ * @param hdr The header to fill.
+ */
+static void compact_header(Block_Header *src, Block_Header *hdr) {
+  hdr->flags = src->flags & ~(size_t)(FL_COPIED | FL_MARK | FL_PREV_FREE);
+  hdr->size = src->size;
+  if (FL_TEST(src, FL_HASHED) && !FL_TEST(src, FL_HASH_SLOT)) {
+    hdr->size += PTRSIZE;
+    hdr->flags |= FL_HASH_SLOT;
+  }
+  if (FL_AGE(hdr) < MINI_CPGC_AGE_MAX)
+    hdr->flags += (size_t)1 << FL_AGE_SHIFT;
+  hdr->next_free = src;
+}
+
+/**
+ * @brief Returns the To-space address of a pointer into the evacuated space.
+ *
+ * @param ptr A candidate pointer.
+ * @return The forwarded pointer, or ptr if it does not point to a live block.
+ */
+static void *compact_forward(void *ptr) {
+  Block_Header *p;
+
+  p = find_block(compact_src, ptr);
+  if (p == NULL || !FL_TEST(p, FL_COPIED))
+    return ptr;
+
+  return (void *)((size_t)p->next_free + ((size_t)ptr - (size_t)p));
+}
+
+/**
+ * @brief Returns a word of the To-space copy of a block.
+ *
+ * @param src The block.
+ * @param off The offset of the word from the header.
+ */
+static size_t compact_word(Block_Header *src, size_t off) {
+  Block_Header hdr;
+  size_t word;
+
+  if (off < BLOCK_HEADER_SIZE) {
+    compact_header(src, &hdr);
+    return ((size_t *)&hdr)[off / PTRSIZE];
+  }
+  if (off >= BLOCK_HEADER_SIZE + src->size)
+    return address_hash(src + 1);
+  word = ((size_t *)src)[off / PTRSIZE];
+  if (FL_TEST(src, FL_STRING | FL_NOSCAN) ||
+      (size_t)src + off >= BODY_END(src))
+    return word;
+
+  return (size_t)compact_forward((void *)word);
+}
+
+/**
+ * @brief Populates a To-space page.
+ *
+ * The page is made accessible first, then every word of it that lies in a
+ * copy is written; the objects overlapping the page are found by a binary
+ * search of compact_moves, which is sorted by destination.
+ *
+ * @param i The index of the page in To-space.
+ */
+static void compact_fill(size_t i) {
+  size_t start = (size_t)compact_dst + i * wp_page_size, end, lo, hi, k;
+  size_t dst, size, addr;
+  Block_Header *src;
+
+  compact_filled[i / WORD_BITS] |= (size_t)1 << (i % WORD_BITS);
+  compact_left--;
+  mprotect((void *)start, wp_page_size, PROT_READ | PROT_WRITE);
+  end = start + wp_page_size < compact_end ? start + wp_page_size : compact_end;
+
+  for (lo = 0, hi = compact_len; lo + 1 < hi;) {
+    k = (lo + hi) / 2;
+    if ((size_t)compact_moves[k]->next_free <= start)
+      lo = k;
+    else
+      hi = k;
+  }
+  for (k = lo; k < compact_len; k++) {
+    src = compact_moves[k];
+    dst = (size_t)src->next_free;
+    if (dst >= end)
+      break;
+    size = BLOCK_HEADER_SIZE + src->size;
+    if (FL_TEST(src, FL_HASHED) && !FL_TEST(src, FL_HASH_SLOT))
+      size += PTRSIZE;
+    for (addr = dst > start ? dst : start; addr < dst + size && addr < end;
+         addr += PTRSIZE)
+      *(size_t *)addr = compact_word(src, addr - dst);
+  }
+}
+
+/**
+ * @brief Populates the page holding a faulting address, if any.
+ *
+ * @param addr The faulting address.
+ * @return true if the fault was on a page not populated yet.
+ */
+static bool compact_fault(size_t addr) {
+  size_t i;
+
+  if (compact_pages == 0 || addr < (size_t)compact_dst)
+    return false;
+  i = (addr - (size_t)compact_dst) / wp_page_size;
+  if (i >= compact_pages || COMPACT_FILLED(i))
+    return false;
+  compact_fill(i);
+
+  return true;
+}
+
+/**
+ * @fn size_t mini_cpgc_compact_step(size_t pages)
+ * @brief Populates pages of a lazy compaction ahead of the program.
+ *
+ * Once every page is populated, the forwarding table is released and the
+ * evacuated space can be reused.
+ *
+ * @param pages The most pages to populate.
+ * @return The number of pages left.
+ */
+size_t mini_cpgc_compact_step(size_t pages) {
+  size_t i;
+
+  if (compact_pages == 0)
+    return 0;
+  for (i = 0; i < compact_pages && pages > 0; i++) {
+    if (COMPACT_FILLED(i))
+      continue;
+    compact_fill(i);
+    pages--;
+  }
+  if (compact_left != 0)
+    return compact_left;
+
+  free(compact_moves);
+  free(compact_filled);
+  compact_moves = NULL;
+  compact_filled = NULL;
+  compact_pages = 0;
+  fault_release();
+
+  return 0;
+}
+
+/**
+ * @brief Completes a lazy compaction, if one is running.
+ */
+static void compact_finish(void) { mini_cpgc_compact_step(SIZE_MAX); }
+
+/**
+ * @brief Assigns the To-space addresses of the marked From-space blocks.
+ *
+ * Survivors are counted in the histograms and site statistics like copy
+ * does, and every block is left forwarded to its future copy.
+ */
+static void compact_assign(void) {
+  Block_Header *p, hdr;
+
+  compact_len = 0;
+  for (p = (Block_Header *)(from_start + 1); (size_t)p < from_start->current;
+       p = NEXT_HEADER(p)) {
+    if (!FL_TEST(p, FL_MARK))
+      continue;
+    p->flags &= ~(size_t)FL_MARK;
+    compact_header(p, &hdr);
+    age_histogram[FL_AGE(&hdr)] += BLOCK_HEADER_SIZE + hdr.size;
+    if (FL_AGE(p) == 0)
+      sites[FL_SITE(p)].survived++;
+    if (type_histogram_enabled)
+      type_histogram_add(&hdr);
+
+    start_span(to_start, (Block_Header *)to_start->current, hdr.size);
+    p->flags |= FL_COPIED;
+    p->next_free = (Block_Header *)to_start->current;
+    to_start->current += BLOCK_HEADER_SIZE + hdr.size;
+    compact_moves[compact_len++] = p;
+  }
+}
+
+/**
+ * @brief Forwards the references outside From-space to the assigned copies.
+ *
+ * Ephemerons are forwarded with both fields strong.
+ */
+static void compact_flip(void) {
+  Block_Header *p;
+  void **body;
+  size_t i;
+
+  for (i = 0; i < roots_len; i++)
+    *roots[i] = forward(*roots[i]);
+  map_forward_all();
+  scan_permanent();
+  for (p = (Block_Header *)(old_start + 1); (size_t)p < old_start->current;
+       p = NEXT_HEADER(p)) {
+    if (FL_TEST(p, FL_MARK)) {
+      scan_block(p);
+      wp_remember(p);
+    }
+  }
+  for (p = buddy_start != NULL ? (Block_Header *)(buddy_start + 1) : NULL;
+       p != NULL && (size_t)p < buddy_start->current; p = NEXT_HEADER(p)) {
+    if (FL_TEST(p, FL_MARK)) {
+      scan_block(p);
+      wp_remember(p);
+    }
+  }
+  for (i = 0; i < ephemerons_len; i++) {
+    ephemerons[i]->flags &= ~(size_t)FL_QUEUED;
+    body = (void **)(ephemerons[i] + 1);
+    body[0] = forward(body[0]);
+    body[1] = forward(body[1]);
+  }
+  ephemerons_len = 0;
+}
+
+/**
+ * @fn void mini_cpgc_compact(void)
+ * @brief Collects, evacuating From-space lazily.
+ *
+ * The pause covers marking, assigning the new addresses and flipping the
+ * references to them; objects are only copied, a page at a time, when the
+ * program first touches their new page or mini_cpgc_compact_step runs.
+ * The next collection completes the compaction first, and so does switching
+ * heaps. Ephemerons are kept with both fields until a copying collection,
+ * strings are not deduplicated, and during a leak check or while a global
+ * variable pins a From-space block a copying collection runs instead.
+ *
+ * The pages not populated yet stay inaccessible and are only filled in on a
+ * fault, so a system call handed a pointer into them, such as read or write
+ * on a buffer object, fails with EFAULT instead. Call
+ * mini_cpgc_compact_step(SIZE_MAX) before passing heap objects to the
+ * kernel.
+ */
+void mini_cpgc_compact(void) {
+  size_t need, pages, blocks;
+
+  compact_finish();
+  need = HEAP_USED(from_start) + hash_pending * PTRSIZE;
+  if (HEAP_CAPACITY(to_start) < need)
+    space_resize(&to_start, need);
+  if (leak_check_fp != NULL || HEAP_CAPACITY(to_start) < need ||
+      data_pins() || !fault_acquire()) {
+    collect(0);
+    return;
+  }
+  pages = ALIGN(to_start->end - (size_t)to_start, wp_page_size) / wp_page_size;
+  blocks = HEAP_USED(from_start) / (BLOCK_HEADER_SIZE + PTRSIZE);
+  compact_moves = malloc(blocks * sizeof(*compact_moves));
+  compact_filled = calloc(ALIGN(pages, WORD_BITS) / WORD_BITS, sizeof(size_t));
+  if ((compact_moves == NULL && blocks != 0) ||
+      compact_filled == NULL) {
+    free(compact_moves);
+    free(compact_filled);
+    fault_release();
+    collect(0);
+    return;
+  }
+
+  hash_pending = 0;
+  to_start->current = (size_t)(to_start + 1);
+  start_reset(to_start);
+  memset(age_histogram, 0, sizeof(age_histogram));
+  if (type_histogram_enabled) {
+    memset(type_histogram, 0, sizeof(type_histogram));
+    memset(size_class_histogram, 0, sizeof(size_class_histogram));
+  }
+  wp_begin();
+  mark_trace();
+  compact_assign();
+  compact_flip();
+  sweep_old();
+  sweep_buddy();
+  swap();
+  site_update();
+  wp_protect();
+
+  compact_src = to_start;
+  compact_dst = from_start;
+  compact_end = from_start->current;
+  compact_pages = ALIGN(compact_end - (size_t)compact_dst, wp_page_size) /
+                  wp_page_size;
+  compact_left = compact_pages;
+  mprotect(compact_dst, compact_pages * wp_page_size, PROT_NONE);
+}
+
+/* ========================================================================== */
+/*  test                                                                      */
+/* ========================================================================== */
+
+static void test_mini_cpgc_malloc_free(void) {
+  void *p;
+  size_t fl, sl;
+
+  /* malloc check */
+  unsigned int alloc_size = 9;
+  p = mini_cpgc_malloc(alloc_size);
+  assert((size_t)(from_start + 1) ==
+         (size_t)(from_start->current - BLOCK_HEADER_SIZE -
+                  ALIGN(alloc_size, PTRSIZE)));
+
+  /* free check */
+  mini_cpgc_free(p);
+  free_class(ALIGN(alloc_size, PTRSIZE), &fl, &sl);
+  assert((Block_Header *)p - 1 == free_lists[fl][sl]);
+}
+
+static void test_garbage_collect(void) {
+  void *p1, *p2;
+  p1 = mini_cpgc_malloc(100);
+  p2 = mini_cpgc_malloc(100);
+  assert(FL_TEST(((Block_Header *)p1 - 1), FL_ALLOC));
+  assert(FL_TEST(((Block_Header *)p2 - 1), FL_ALLOC));
+
+  mini_cpgc_free(p1);
+  copying();
+  assert(FL_TEST((Block_Header *)((from_start + 1) - 1), FL_ALLOC));
+}
+
+static void test_copying_roots(void) {
+  void **list = NULL, **node;
+  int i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&list);
+
+  /* list -> node(1) -> node(0) */
+  for (i = 0; i < 2; i++) {
+    node = mini_cpgc_malloc(2 * PTRSIZE);
+    node[0] = list;
+    node[1] = (void *)(size_t)i;
+    list = node;
+  }
+  /* garbage forces several collections */
+  for (i = 0; i < 1000; i++)
+    mini_cpgc_malloc(100);
+
+  assert((size_t)list > (size_t)(from_start + 1) &&
+         (size_t)list < from_start->current);
+  assert(list[1] == (void *)1);
+  assert(((void **)list[0])[1] == (void *)0);
+  assert(((void **)list[0])[0] == NULL);
+
+  mini_cpgc_remove_root((void **)&list);
+  copying();
+  assert(HEAP_USED(from_start) == 0);
+}
+
+static void test_malloc_atomic(void) {
+  void **words = NULL, *obj;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&words);
+
+  /* an integer that equals an object address is left alone */
+  words = mini_cpgc_malloc_atomic(2 * PTRSIZE);
+  assert(FL_TEST((Block_Header *)words - 1, FL_NOSCAN));
+  obj = mini_cpgc_malloc(2 * PTRSIZE);
+  words[0] = obj;
+  words[1] = (char *)obj + PTRSIZE;
+  copying();
+  assert(words[0] == obj);
+  assert(words[1] == (char *)obj + PTRSIZE);
+  assert(HEAP_USED(from_start) == BLOCK_HEADER_SIZE + 2 * PTRSIZE);
+  assert(FL_TEST((Block_Header *)words - 1, FL_NOSCAN));
+
+  mini_cpgc_remove_root((void **)&words);
+  copying();
+  assert(HEAP_USED(from_start) == 0);
+}
+
+static void test_soft_limit(void) {
+  char dir[] = "/tmp/mini_cpgc_XXXXXX", path[PATH_MAX];
+  FILE *fp;
+  int i;
+
+  assert(mkdtemp(dir) != NULL);
+  snprintf(path, sizeof(path), "%s/memory.max", dir);
+  fp = fopen(path, "w");
+  fputs("1048576\n", fp);
+  fclose(fp);
+  snprintf(path, sizeof(path), "%s/memory.high", dir);
+  fp = fopen(path, "w");
+  fputs("max\n", fp);
+  fclose(fp);
+
+  mini_cpgc_set_soft_limit(0);
+  mini_cpgc_set_cgroup_dir(dir);
+  heap_init(0x1000000);
+  assert(mini_cpgc_soft_limit() == 1048576 / 100 * CGROUP_HEAP_PERCENT);
+  assert(from_start->size * 2 <= mini_cpgc_soft_limit());
+
+  /* garbage never grows the heap past the limit */
+  for (i = 0; i < 10000; i++)
+    mini_cpgc_malloc(1000);
+  assert(from_start->size * 2 <= mini_cpgc_soft_limit());
+  assert(to_start->size * 2 <= mini_cpgc_soft_limit());
+
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/memory.max", dir);
+  unlink(path);
+  rmdir(dir);
+  mini_cpgc_set_cgroup_dir(NULL);
+  mini_cpgc_set_soft_limit(0);
+
+  /* a request no space can hold fails at once */
+  assert(mini_cpgc_malloc((size_t)1 << 62) == NULL);
+  assert(mini_cpgc_malloc(SIZE_MAX) == NULL);
+}
+
+static void test_numa_placement(void) {
+  heap_init(TINY_HEAP_SIZE);
+  assert(numa_node_count() >= 1);
+  assert((size_t)from_start % OS_PAGE_SIZE == 0);
+  assert((size_t)to_start % OS_PAGE_SIZE == 0);
+
+  /* mbind may be refused, leaving the space unbound */
+  copying();
+  assert(from_start->node >= -1 && from_start->node < numa_node_count());
+  if (numa_node_count() < 2)
+    assert(from_start->node == -1);
+}
+
+static void test_age_histogram(void) {
+  void *old = NULL, *young;
+  const size_t *hist;
+  int i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root(&old);
+  old = mini_cpgc_malloc(PTRSIZE);
+  for (i = 0; i < 3; i++)
+    copying();
+  young = mini_cpgc_malloc(3 * PTRSIZE);
+  mini_cpgc_add_root(&young);
+  copying();
+
+  hist = mini_cpgc_age_histogram();
+  assert(FL_AGE((Block_Header *)old - 1) == 4);
+  assert(FL_AGE((Block_Header *)young - 1) == 1);
+  assert(hist[4] == BLOCK_HEADER_SIZE + PTRSIZE);
+  assert(hist[1] == BLOCK_HEADER_SIZE + 3 * PTRSIZE);
+  assert(hist[2] == 0 && hist[3] == 0);
+
+  for (i = 0; i < MINI_CPGC_AGE_MAX + 2; i++)
+    copying();
+  assert(FL_AGE((Block_Header *)old - 1) == MINI_CPGC_AGE_MAX);
+  assert(hist[MINI_CPGC_AGE_MAX] == 2 * BLOCK_HEADER_SIZE + 4 * PTRSIZE);
+
+  mini_cpgc_remove_root(&old);
+  mini_cpgc_remove_root(&young);
+}
+
+static void test_pretenuring(void) {
+  void **table = NULL, *dead;
+  int i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&table);
+  table = mini_cpgc_malloc(PRETENURE_MIN_SAMPLES * PTRSIZE);
+
+  /* site 7 always survives, site 8 never does */
+  for (i = 0; i < PRETENURE_MIN_SAMPLES; i++) {
+    table[i] = mini_cpgc_malloc_site(PTRSIZE, 7);
+    mini_cpgc_malloc_site(PTRSIZE, 8);
+  }
+  copying();
+  assert(mini_cpgc_site_pretenured(7));
+  assert(!mini_cpgc_site_pretenured(8));
+  assert(!mini_cpgc_site_pretenured(MINI_CPGC_NO_SITE));
+
+  /* pretenured objects are not moved, and are still traced */
+  table[0] = mini_cpgc_malloc_site(2 * PTRSIZE, 7);
+  assert(IN_HEAP(old_start, table[0]));
+  ((void **)table[0])[0] = mini_cpgc_malloc(PTRSIZE);
+  *(size_t *)((void **)table[0])[0] = 42;
+  dead = table[0];
+  copying();
+  assert(table[0] == dead);
+  assert(IN_HEAP(from_start, ((void **)table[0])[0]));
+  assert(*(size_t *)((void **)table[0])[0] == 42);
+
+  /* unreachable old objects are swept and reused */
+  dead = mini_cpgc_malloc_site(PTRSIZE, 7);
+  copying();
+  assert(FL_TEST((Block_Header *)dead - 1, FL_ALLOC) == 0);
+  assert(mini_cpgc_malloc_site(PTRSIZE, 7) == dead);
+
+  mini_cpgc_remove_root((void **)&table);
+}
+
+static void test_ephemeron(void) {
+  void **table = NULL, **key = NULL, **e;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&table);
+  mini_cpgc_add_root((void **)&key);
+  table = mini_cpgc_malloc(3 * PTRSIZE);
+  memset(table, 0, 3 * PTRSIZE);
+
+  /* live key; its value is only reachable as the key of the next one */
+  key = mini_cpgc_malloc(PTRSIZE);
+  table[0] = mini_cpgc_ephemeron(key, mini_cpgc_malloc(PTRSIZE));
+  e = table[0];
+  table[1] = mini_cpgc_ephemeron(e[1], mini_cpgc_malloc(PTRSIZE));
+  e = table[1];
+  *(size_t *)e[1] = 7;
+  /* dead key */
+  table[2] = mini_cpgc_ephemeron(mini_cpgc_malloc(PTRSIZE),
+                                 mini_cpgc_malloc(PTRSIZE));
+
+  copying();
+  e = table[0];
+  assert(e[0] == key && e[1] != NULL);
+  e = table[1];
+  assert(e[0] == ((void **)table[0])[1] && *(size_t *)e[1] == 7);
+  e = table[2];
+  assert(e[0] == NULL && e[1] == NULL);
+
+  key = NULL;
+  copying();
+  e = table[0];
+  assert(e[0] == NULL && e[1] == NULL);
+  e = table[1];
+  assert(e[0] == NULL && e[1] == NULL);
+
+  mini_cpgc_remove_root((void **)&key);
+  mini_cpgc_remove_root((void **)&table);
+}
+
+static void test_string_dedup(void) {
+  void **table = NULL, *old, *s;
+  size_t used;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&table);
+  table = mini_cpgc_malloc(4 * PTRSIZE);
+  table[0] = mini_cpgc_string("hello", 6);
+  table[1] = mini_cpgc_string("hello", 6);
+  table[2] = mini_cpgc_string("a much longer string", 21);
+  table[3] = mini_cpgc_string("a much longer string", 21);
+
+  copying();
+  assert(table[0] != table[1] && table[2] != table[3]);
+  used = HEAP_USED(from_start);
+
+  mini_cpgc_set_dedup(1);
+  copying();
+  assert(table[0] == table[1] && table[2] == table[3]);
+  assert(table[0] != table[2]);
+  assert(strcmp(table[0], "hello") == 0);
+  assert(strcmp(table[3], "a much longer string") == 0);
+  assert(HEAP_USED(from_start) ==
+         used - 2 * BLOCK_HEADER_SIZE - ALIGN(6, PTRSIZE) -
+             ALIGN(21, PTRSIZE));
+  mini_cpgc_set_dedup(0);
+
+  /* the source moves when the From-space is full */
+  while (HEAP_FITS(from_start, ALIGN(21, PTRSIZE)))
+    mini_cpgc_malloc(PTRSIZE);
+  old = table[3];
+  s = mini_cpgc_string(old, 21);
+  assert(table[3] != old);
+  assert(strcmp(s, "a much longer string") == 0);
+
+  mini_cpgc_remove_root((void **)&table);
+}
+
+static void test_identity_hash(void) {
+  void **obj = NULL;
+  size_t hash, size;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&obj);
+  obj = mini_cpgc_malloc(2 * PTRSIZE);
+  obj[0] = obj;
+  obj[1] = (void *)0x5;
+  size = ((Block_Header *)obj - 1)->size;
+  hash = mini_cpgc_identity_hash(obj);
+  assert(mini_cpgc_identity_hash(obj) == hash);
+
+  copying();
+  assert(mini_cpgc_identity_hash(obj) == hash);
+  assert(((Block_Header *)obj - 1)->size == size + PTRSIZE);
+  assert(obj[0] == obj && obj[1] == (void *)0x5);
+
+  copying();
+  assert(mini_cpgc_identity_hash(obj) == hash);
+  assert(((Block_Header *)obj - 1)->size == size + PTRSIZE);
+
+  mini_cpgc_remove_root((void **)&obj);
+}
+
+static void test_map(void) {
+  void **keys = NULL;
+  Mini_Cpgc_Map *map;
+  size_t i, n = 64;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&keys);
+  keys = mini_cpgc_malloc(n * PTRSIZE);
+  map = mini_cpgc_map_new();
+  for (i = 0; i < n; i++) {
+    keys[i] = mini_cpgc_malloc(PTRSIZE);
+    assert(mini_cpgc_map_put(map, keys[i], (void *)(i + 1)));
+  }
+
+  /* one collection: lookups migrate only their own bucket */
+  copying();
+  assert(mini_cpgc_map_get(map, keys[0]) == (void *)1);
+  assert(map->stale.len > 0 && map->stale.len < n);
+  for (i = 0; i < n; i++)
+    assert(mini_cpgc_map_get(map, keys[i]) == (void *)(i + 1));
+  assert(map->stale.len == 0 && map->cur.len == n);
+
+  /* several collections: the map is rehashed */
+  copying();
+  assert(mini_cpgc_map_remove(map, keys[1]));
+  copying();
+  copying();
+  assert(mini_cpgc_map_get(map, keys[1]) == NULL);
+  for (i = 2; i < n; i++)
+    assert(mini_cpgc_map_get(map, keys[i]) == (void *)(i + 1));
+
+  /* entries keep their keys alive */
+  keys[0] = NULL;
+  copying();
+  assert(map->cur.len + map->stale.len == n - 1);
+
+  mini_cpgc_map_delete(map);
+  mini_cpgc_remove_root((void **)&keys);
+}
+
+static void test_map_moved_keys(void) {
+  void **keys = NULL, **strings = NULL, *key, *first[32];
+  Mini_Cpgc_Map *map;
+  char text[16];
+  size_t i, n = 32;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&keys);
+  mini_cpgc_add_root((void **)&strings);
+  map = mini_cpgc_map_new();
+
+  /* freezing moves the keys out of From-space */
+  keys = mini_cpgc_malloc(n * PTRSIZE);
+  for (i = 0; i < n; i++) {
+    key = mini_cpgc_malloc(PTRSIZE);
+    keys[i] = key;
+    assert(mini_cpgc_map_put(map, key, (void *)(i + 1)));
+  }
+  keys = mini_cpgc_freeze(keys);
+  for (i = 0; i < n; i++) {
+    assert(is_frozen(keys[i]));
+    assert(mini_cpgc_map_get(map, keys[i]) == (void *)(i + 1));
+  }
+
+  /* deduplication merges each key into an equal string rooted earlier */
+  strings = mini_cpgc_malloc(n * PTRSIZE);
+  for (i = 0; i < n; i++) {
+    snprintf(text, sizeof(text), "key %zu", i);
+    first[i] = mini_cpgc_string(text, strlen(text) + 1);
+    mini_cpgc_add_root(&first[i]);
+    key = mini_cpgc_string(text, strlen(text) + 1);
+    strings[i] = key;
+    assert(mini_cpgc_map_put(map, key, (void *)(i + 1)));
+  }
+  mini_cpgc_set_dedup(1);
+  copying();
+  mini_cpgc_set_dedup(0);
+  for (i = 0; i < n; i++) {
+    assert(strings[i] == first[i]);
+    assert(mini_cpgc_map_get(map, first[i]) == (void *)(i + 1));
+    mini_cpgc_remove_root(&first[i]);
+  }
+
+  mini_cpgc_map_delete(map);
+  mini_cpgc_remove_root((void **)&strings);
+  mini_cpgc_remove_root((void **)&keys);
+}
+
+static void test_interior_pointer(void) {
+  char *inner = NULL;
+  void **obj;
+  size_t i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&inner);
+  for (i = 0; i < 8; i++)
+    mini_cpgc_malloc(PTRSIZE);
+  obj = mini_cpgc_malloc(100 * PTRSIZE);
+  for (i = 0; i < 100; i++)
+    obj[i] = (void *)i;
+  mini_cpgc_malloc(PTRSIZE);
+
+  assert(mini_cpgc_base(&obj[0]) == obj);
+  assert(mini_cpgc_base(&obj[99]) == obj);
+  assert(mini_cpgc_base((char *)&obj[70] + 3) == obj);
+  assert(mini_cpgc_base((Block_Header *)obj - 1) == NULL);
+
+  /* only an interior pointer keeps the object alive */
+  inner = (char *)&obj[70] + 3;
+  copying();
+  obj = mini_cpgc_base(inner);
+  assert(obj == (void *)(from_start + 1) + BLOCK_HEADER_SIZE);
+  assert(inner == (char *)&obj[70] + 3);
+  for (i = 0; i < 100; i++)
+    assert(obj[i] == (void *)i);
+
+  /* the card of the tail names the card of the header */
+  i = START_BIT(from_start, &obj[99]) / WORD_BITS;
+  assert(i > 0 && from_start->crossing[i] == i);
+
+  /* free space resolves to no object, even after part of it is reused */
+  mini_cpgc_remove_root((void **)&inner);
+  mini_cpgc_malloc(PTRSIZE);
+  mini_cpgc_free(obj);
+  assert(mini_cpgc_base(&obj[99]) == NULL);
+  assert(mini_cpgc_malloc(PTRSIZE) == obj);
+  assert(mini_cpgc_base(&obj[0]) == obj);
+  assert(mini_cpgc_base(&obj[99]) == NULL);
+}
+
+static void test_permanent(void) {
+  void **perm, **raw, *p;
+  size_t used;
+
+  heap_init(TINY_HEAP_SIZE);
+  perm = mini_cpgc_malloc_permanent(PTRSIZE, 0);
+  raw = mini_cpgc_malloc_permanent(PTRSIZE, 1);
+  assert(IN_HEAP(perm_start, perm) && IN_HEAP(perm_start, raw));
+
+  perm[0] = mini_cpgc_malloc(PTRSIZE);
+  *(size_t *)perm[0] = 42;
+  used = HEAP_USED(from_start);
+  p = mini_cpgc_malloc(PTRSIZE);
+  raw[0] = p;
+
+  copying();
+  copying();
+  /* perm[0] is kept alive and forwarded, raw[0] is neither */
+  assert(*(size_t *)perm[0] == 42);
+  assert(HEAP_USED(from_start) == used);
+  assert(raw[0] == p);
+  assert(mini_cpgc_base(&perm[0]) == perm);
+
+  mini_cpgc_free(perm);
+  assert(FL_TEST((Block_Header *)perm - 1, FL_ALLOC));
+}
+
+static void test_freeze(void) {
+  void **list = NULL, **holder = NULL, **node, **frozen_list;
+  size_t i, used, age;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&list);
+  mini_cpgc_add_root((void **)&holder);
+  for (i = 0; i < 3; i++) {
+    node = mini_cpgc_malloc(2 * PTRSIZE);
+    node[0] = list;
+    node[1] = (void *)i;
+    list = node;
+  }
+  holder = mini_cpgc_malloc(PTRSIZE);
+  holder[0] = list[0];
+  copying();
+  used = HEAP_USED(from_start);
+  age = FL_AGE((Block_Header *)list - 1);
+
+  frozen_list = mini_cpgc_freeze(list);
+  assert(is_frozen(frozen_list));
+  assert(FL_AGE((Block_Header *)frozen_list - 1) == age);
+  assert(list == frozen_list);
+  assert(holder[0] == frozen_list[0]);
+  assert(HEAP_USED(from_start) == used - 3 * (BLOCK_HEADER_SIZE + 2 * PTRSIZE));
+  for (node = list, i = 3; node != NULL; node = node[0])
+    assert(node[1] == (void *)--i);
+
+  /* frozen objects stay put and keep nothing else alive */
+  copying();
+  assert(list == frozen_list && holder[0] == frozen_list[0]);
+  assert(mini_cpgc_identity_hash(list) == mini_cpgc_identity_hash(list));
+  mini_cpgc_free(list);
+
+  mini_cpgc_remove_root((void **)&holder);
+  mini_cpgc_remove_root((void **)&list);
+}
+
+static void **test_global;
+
+static void test_data_segment_roots(void) {
+  void **other = NULL, *pinned;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&other);
+  mini_cpgc_set_scan_data_segments(1);
+  mini_cpgc_malloc(PTRSIZE);
+  test_global = mini_cpgc_malloc(2 * PTRSIZE);
+  other = mini_cpgc_malloc(PTRSIZE);
+  test_global[0] = other;
+  test_global[1] = (void *)0x2a;
+  pinned = test_global;
+
+  /* the global is left alone, the other survivors are promoted */
+  copying();
+  assert(data_ranges_len > 0);
+  assert(test_global == pinned && IN_HEAP(from_start, test_global));
+  assert(test_global[0] == other && IN_HEAP(old_start, other));
+  assert(test_global[1] == (void *)0x2a);
+  assert(!FL_TEST((Block_Header *)test_global - 1, FL_MARK));
+  assert(free_listed((Block_Header *)(from_start + 1)));
+  assert(from_start->current ==
+         (size_t)NEXT_HEADER((Block_Header *)pinned - 1));
+
+  /* neither compaction nor freezing may move it */
+  mini_cpgc_compact();
+  assert(test_global == pinned && test_global[1] == (void *)0x2a);
+  assert(mini_cpgc_freeze(test_global) == pinned);
+  assert(!is_frozen(test_global) && !is_frozen(other));
+  copying();
+  assert(test_global == pinned && test_global[0] == other);
+
+  /* once no global points to it, it is collected */
+  test_global = NULL;
+  copying();
+  assert(HEAP_USED(from_start) == 0);
+  mini_cpgc_set_scan_data_segments(0);
+  mini_cpgc_remove_root((void **)&other);
+}
+
+static void test_type_histogram(void) {
+  void **table = NULL;
+  const Mini_Cpgc_Type_Stats *types, *sizes;
+  char buf[1024];
+  FILE *fp;
+  int i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_set_type_histogram(1);
+  mini_cpgc_add_root((void **)&table);
+  table = mini_cpgc_malloc(8 * PTRSIZE);
+  for (i = 0; i < 3; i++)
+    table[i] = mini_cpgc_malloc_site(3 * PTRSIZE, 5);
+  for (i = 3; i < 8; i++)
+    table[i] = mini_cpgc_malloc(PTRSIZE);
+  mini_cpgc_malloc_site(3 * PTRSIZE, 5);
+  copying();
+
+  types = mini_cpgc_type_histogram();
+  sizes = mini_cpgc_size_class_histogram();
+  assert(types[5].count == 3);
+  assert(types[5].bytes == 3 * (BLOCK_HEADER_SIZE + 3 * PTRSIZE));
+  assert(sizes[4].count == 5);       /* 8 bytes */
+  assert(sizes[7].count == 1);       /* 64 bytes */
+
+  fp = fmemopen(buf, sizeof(buf), "w");
+  mini_cpgc_dump_type_histogram(fp);
+  fclose(fp);
+  assert(strstr(buf, "site 5") != NULL);
+  assert(strstr(buf, "size 8") != NULL);
+  assert(strstr(buf, "size 64") != NULL);
+
+  mini_cpgc_set_type_histogram(0);
+  mini_cpgc_remove_root((void **)&table);
+}
+
+static void test_heap_snapshot(void) {
+  void **a = NULL;
+  char magic[8];
+  uint64_t count, address, size;
+  uint32_t type, degree, edges[2];
+  FILE *fp;
+  int i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&a);
+  a = mini_cpgc_malloc_site(2 * PTRSIZE, 7);
+  a[0] = mini_cpgc_malloc(PTRSIZE);
+  a[1] = mini_cpgc_malloc(3 * PTRSIZE);
+  mini_cpgc_malloc(PTRSIZE);
+
+  fp = tmpfile();
+  assert(mini_cpgc_write_snapshot(fp));
+  rewind(fp);
+  assert(fread(magic, sizeof(magic), 1, fp) == 1);
+  assert(memcmp(magic, MINI_CPGC_SNAPSHOT_MAGIC, sizeof(magic)) == 0);
+  assert(fread(&count, sizeof(count), 1, fp) == 1);
+  assert(count == 4);
+  for (i = 0; i < 4; i++) {
+    assert(fread(&address, sizeof(address), 1, fp) == 1);
+    assert(fread(&size, sizeof(size), 1, fp) == 1);
+    assert(fread(&type, sizeof(type), 1, fp) == 1);
+    assert(fread(&degree, sizeof(degree), 1, fp) == 1);
+    assert(degree <= 2);
+    assert(fread(edges, sizeof(*edges), degree, fp) == degree);
+    if (i == 0) {
+      assert(address == 0 && degree == 1);
+    } else if (address == (uint64_t)(size_t)a) {
+      assert(type == 7 && degree == 2);
+      assert(size == BLOCK_HEADER_SIZE + 2 * PTRSIZE);
+    } else {
+      assert(type == MINI_CPGC_NO_SITE && degree == 0);
+    }
+  }
+  assert(fgetc(fp) == EOF);
+  fclose(fp);
+
+  mini_cpgc_remove_root((void **)&a);
+}
+
+static void test_leak_check(void) {
+  void **a = NULL, *c;
+  char buf[512];
+  FILE *fp;
+
+  heap_init(TINY_HEAP_SIZE);
+  fp = fmemopen(buf, sizeof(buf), "w");
+  mini_cpgc_set_leak_check(fp);
+  mini_cpgc_add_root((void **)&a);
+  a = mini_cpgc_malloc_site(PTRSIZE, 1);
+  mini_cpgc_malloc_site(2 * PTRSIZE, 2);
+  c = mini_cpgc_malloc_site(3 * PTRSIZE, 3);
+  a[0] = c;
+  mini_cpgc_free(c);
+  mini_cpgc_free(mini_cpgc_malloc_site(PTRSIZE, 4));
+  c = NULL;
+  copying();
+  fclose(fp);
+
+  assert(mini_cpgc_leaked()[1].count == 0);
+  assert(mini_cpgc_leaked()[2].count == 1);
+  assert(mini_cpgc_leaked()[2].bytes == BLOCK_HEADER_SIZE + 2 * PTRSIZE);
+  assert(mini_cpgc_freed_reachable()[3].count == 1);
+  assert(mini_cpgc_leaked()[4].count == 0);
+  assert(mini_cpgc_freed_reachable()[4].count == 0);
+  assert(strstr(buf, "site 2: 1 blocks") != NULL);
+  assert(strstr(buf, "site 3: 1 blocks") != NULL);
+  assert(strstr(buf, "site 4") == NULL);
+
+  /* the old copy left behind by mini_cpgc_freeze is no leak */
+  fp = fmemopen(buf, sizeof(buf), "w");
+  mini_cpgc_set_leak_check(fp);
+  a = old_malloc(PTRSIZE, FL_ALLOC);
+  a = mini_cpgc_freeze(a);
+  assert(is_frozen(a) && mini_cpgc_leaked()[0].count == 0);
+  mini_cpgc_set_leak_check(NULL);
+  fclose(fp);
+  mini_cpgc_remove_root((void **)&a);
+}
+
+static void test_free_coalescing(void) {
+  void *a, *b, *c, *d, *e;
+  Block_Header *p;
+  size_t fl, sl;
+
+  heap_init(TINY_HEAP_SIZE);
+  a = mini_cpgc_malloc(4 * PTRSIZE);
+  b = mini_cpgc_malloc(4 * PTRSIZE);
+  c = mini_cpgc_malloc(4 * PTRSIZE);
+  d = mini_cpgc_malloc(PTRSIZE);
+  mini_cpgc_free(a);
+  mini_cpgc_free(c);
+  p = (Block_Header *)d - 1;
+  assert(FL_TEST(p, FL_PREV_FREE));
+
+  /* b merges with both neighbours into one block */
+  mini_cpgc_free(b);
+  p = (Block_Header *)a - 1;
+  assert(p->size == 3 * (4 * PTRSIZE) + 2 * BLOCK_HEADER_SIZE);
+  free_class(p->size, &fl, &sl);
+  assert(free_lists[fl][sl] == p && p->next_free == NULL);
+  assert(FREE_FOOTER(p) == p);
+  assert(find_block(from_start, c) == NULL);
+
+  /* reused first fit, the rest stays free and tagged */
+  e = mini_cpgc_malloc(2 * PTRSIZE);
+  assert(e == a);
+  p = NEXT_HEADER((Block_Header *)e - 1);
+  assert(!FL_TEST(p, FL_ALLOC) && FREE_FOOTER(p) == p);
+  assert(FL_TEST((Block_Header *)d - 1, FL_PREV_FREE));
+  mini_cpgc_free(e);
+  p = (Block_Header *)a - 1;
+  assert(p->size == 3 * (4 * PTRSIZE) + 2 * BLOCK_HEADER_SIZE);
+}
+
+static void test_buddy(void) {
+  void *a, *b, **c = NULL;
+  Block_Header *base;
+  size_t k;
+
+  heap_init(TINY_HEAP_SIZE);
+  assert(mini_cpgc_buddy_init(1000));
+  assert(buddy_orders == 6);
+  base = (Block_Header *)(buddy_start + 1);
+
+  a = mini_cpgc_malloc_buddy(PTRSIZE);
+  b = mini_cpgc_malloc_buddy(PTRSIZE);
+  assert((Block_Header *)a - 1 == base);
+  assert(BUDDY_OFFSET((Block_Header *)b - 1) == BUDDY_BLOCK(0));
+  for (k = 1; k < 5; k++)
+    assert(BUDDY_OFFSET(buddy_lists[k]) == BUDDY_BLOCK(k));
+  assert(mini_cpgc_malloc_buddy(BUDDY_BLOCK(5)) == NULL);
+
+  /* freeing both buddies merges the space back into one block */
+  mini_cpgc_free(a);
+  assert(buddy_is_free((Block_Header *)a - 1, 0));
+  mini_cpgc_free(b);
+  assert(buddy_lists[5] == base && base->next_free == NULL);
+  for (k = 0; k < 5; k++)
+    assert(buddy_lists[k] == NULL);
+
+  /* unreachable blocks are swept, reachable ones keep their references */
+  mini_cpgc_add_root((void **)&c);
+  c = mini_cpgc_malloc_buddy(2 * PTRSIZE);
+  c[0] = mini_cpgc_malloc(PTRSIZE);
+  *(size_t *)c[0] = 42;
+  mini_cpgc_malloc_buddy(100);
+  copying();
+  assert((Block_Header *)c - 1 == base);
+  assert(*(size_t *)c[0] == 42 && IN_HEAP(from_start, c[0]));
+  assert(buddy_is_free((Block_Header *)((size_t)base + BUDDY_BLOCK(4)), 4));
+  mini_cpgc_remove_root((void **)&c);
+  copying();
+  assert(buddy_lists[5] == base);
+
+  /* a buddy key keeps the value of an ephemeron alive until it dies */
+  mini_cpgc_add_root(&a);
+  mini_cpgc_add_root((void **)&c);
+  a = mini_cpgc_malloc_buddy(PTRSIZE);
+  c = mini_cpgc_ephemeron(a, mini_cpgc_malloc(PTRSIZE));
+  copying();
+  assert(c[0] == a && IN_HEAP(from_start, c[1]));
+  a = NULL;
+  copying();
+  assert(c[0] == NULL && c[1] == NULL);
+  copying();
+  assert(buddy_lists[5] == base);
+  mini_cpgc_remove_root((void **)&c);
+  mini_cpgc_remove_root(&a);
+}
+
+static void test_free_best_fit(void) {
+  void *big, *small, *p;
+  size_t fl, sl;
+
+  heap_init(TINY_HEAP_SIZE);
+  big = mini_cpgc_malloc(40 * PTRSIZE);
+  mini_cpgc_malloc(PTRSIZE);
+  small = mini_cpgc_malloc(20 * PTRSIZE);
+  mini_cpgc_malloc(PTRSIZE);
+  mini_cpgc_free(small);
+  mini_cpgc_free(big);
+
+  free_class(20 * PTRSIZE, &fl, &sl);
+  assert(fl == 1 && sl == 4);
+  assert(free_sl_map[fl] == (size_t)1 << sl);
+  free_class(40 * PTRSIZE, &fl, &sl);
+  assert(fl == 2 && sl == 4);
+
+  /* the tightest class wins over the first block freed */
+  p = mini_cpgc_malloc(18 * PTRSIZE);
+  assert(p == small);
+  assert(free_sl_map[1] == 0 && free_fl_map == (size_t)1 << 2);
+  p = mini_cpgc_malloc(30 * PTRSIZE);
+  assert(p == big);
+  p = mini_cpgc_malloc(PTRSIZE);
+  assert(p == (void *)((size_t)big + 30 * PTRSIZE + BLOCK_HEADER_SIZE));
+}
+
+static void test_clone(void) {
+  void **a = NULL, **b, **copy = NULL, *s;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&a);
+  mini_cpgc_add_root((void **)&copy);
+  /* a -> b -> a, both -> s, and a -> a permanent object */
+  a = mini_cpgc_malloc_site(4 * PTRSIZE, 3);
+  b = mini_cpgc_malloc(2 * PTRSIZE);
+  a[0] = b;
+  b[0] = a;
+  s = mini_cpgc_string("shared", 7);
+  a[1] = s;
+  b[1] = (char *)s + 2;
+  a[2] = mini_cpgc_malloc_permanent(PTRSIZE, 1);
+  a[3] = (void *)42;
+  mini_cpgc_identity_hash(a);
+  copying();
+
+  copy = mini_cpgc_clone(a);
+  assert(copy != NULL && copy != a);
+  assert(FL_SITE((Block_Header *)copy - 1) == 3);
+  assert(!FL_TEST((Block_Header *)copy - 1, FL_HASHED | FL_HASH_SLOT));
+  assert(((Block_Header *)copy - 1)->size == 4 * PTRSIZE);
+  b = copy[0];
+  assert(b != a[0] && b[0] == (void *)copy);
+  assert(copy[1] != a[1] && (char *)b[1] == (char *)copy[1] + 2);
+  assert(strcmp(copy[1], "shared") == 0);
+  assert(copy[2] == a[2] && copy[3] == (void *)42);
+
+  /* the originals were not disturbed */
+  assert(((void **)a[0])[0] == (void *)a);
+  assert(!FL_TEST((Block_Header *)a - 1, FL_COPIED));
+  copying();
+  assert(((void **)copy[0])[0] == (void *)copy);
+  assert(strcmp(copy[1], "shared") == 0);
+
+  /* a full From-space is collected first */
+  while (HEAP_FITS(from_start, BLOCK_HEADER_SIZE))
+    mini_cpgc_malloc(PTRSIZE);
+  copy = mini_cpgc_clone(copy);
+  assert(copy != NULL && ((void **)copy[0])[0] == (void *)copy);
+  assert(strcmp(copy[1], "shared") == 0 && copy[3] == (void *)42);
+
+  mini_cpgc_remove_root((void **)&copy);
+  mini_cpgc_remove_root((void **)&a);
+}
+
+static void test_serialize(void) {
+  void **a = NULL, **b, *buf, *img;
+  size_t size, *perm, *words, *map, n, wrap[8];
+  Serial_Header *h;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&a);
+  a = mini_cpgc_malloc_site(4 * PTRSIZE, 9);
+  b = mini_cpgc_malloc(2 * PTRSIZE);
+  a[0] = b;
+  b[0] = a;
+  a[1] = mini_cpgc_string("relocatable", 12);
+  b[1] = (char *)a[1] + 4;
+  perm = mini_cpgc_malloc_permanent(PTRSIZE, 1);
+  *perm = 7;
+  a[2] = perm;
+  a[3] = (void *)42;
+
+  size = mini_cpgc_serialize(a, NULL, 0);
+  assert(size > 0);
+  buf = malloc(size);
+  assert(mini_cpgc_serialize(a, buf, size) == size);
+  assert(mini_cpgc_serialize((void *)42, buf, size) == 0);
+
+  /* the image holds no address, so it survives a new heap */
+  mini_cpgc_remove_root((void **)&a);
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&a);
+  a = mini_cpgc_deserialize(buf, size);
+  assert(a != NULL && IN_HEAP(from_start, a));
+  assert(FL_SITE((Block_Header *)a - 1) == 9);
+  b = a[0];
+  assert(IN_HEAP(from_start, b) && b[0] == (void *)a);
+  assert(strcmp(a[1], "relocatable") == 0 && b[1] == (char *)a[1] + 4);
+  assert(IN_HEAP(from_start, a[2]) && *(size_t *)a[2] == 7);
+  assert(a[3] == (void *)42);
+  copying();
+  assert(((void **)a[0])[0] == (void *)a && *(size_t *)a[2] == 7);
+
+  assert(mini_cpgc_deserialize(buf, size - 1) == NULL);
+
+  /* flags on headers, offsets out of the image and header roots */
+  h = img = malloc(size);
+  words = (size_t *)(h + 1);
+  map = (size_t *)((size_t)(h + 1) + ((Serial_Header *)buf)->objects);
+  n = ((Serial_Header *)buf)->objects / PTRSIZE;
+  memcpy(img, buf, size);
+  map[0] |= 1;
+  assert(mini_cpgc_deserialize(img, size) == NULL);
+  memcpy(img, buf, size);
+  assert((map[0] >> (BLOCK_HEADER_SIZE / PTRSIZE) & 1) != 0);
+  words[BLOCK_HEADER_SIZE / PTRSIZE] = h->objects;
+  assert(mini_cpgc_deserialize(img, size) == NULL);
+  memcpy(img, buf, size);
+  h->root = 0;
+  assert(mini_cpgc_deserialize(img, size) == NULL);
+  if (n % WORD_BITS != 0) {
+    memcpy(img, buf, size);
+    map[n / WORD_BITS] |= (size_t)1 << (n % WORD_BITS);
+    assert(mini_cpgc_deserialize(img, size) == NULL);
+  }
+  /* an ephemeron whose value would be the next header */
+  memcpy(img, buf, size);
+  ((Block_Header *)(h + 1))->flags |= FL_EPHEMERON;
+  assert(mini_cpgc_deserialize(img, size) == NULL);
+  memcpy(img, buf, size);
+  assert(mini_cpgc_deserialize(img, size) != NULL);
+  free(img);
+
+  /* a size whose sum with the header and the map wraps around */
+  memset(wrap, 0, sizeof(wrap));
+  h = (Serial_Header *)wrap;
+  memcpy(h->magic, SERIAL_MAGIC, sizeof(h->magic));
+  h->objects = (size_t)0xfc0fc0fc0fc0fc08;
+  h->size = sizeof(*h) + h->objects + SERIAL_MAP_SIZE(h->objects);
+  ((Block_Header *)(h + 1))->flags = FL_ALLOC;
+  ((Block_Header *)(h + 1))->size = PTRSIZE;
+  assert(h->size <= sizeof(wrap));
+  assert(mini_cpgc_deserialize(wrap, sizeof(wrap)) == NULL);
+
+  memset(buf, 0, 8);
+  assert(mini_cpgc_deserialize(buf, size) == NULL);
+  free(buf);
+  mini_cpgc_remove_root((void **)&a);
+}
+
+static void test_transfer(void) {
+  void **a = NULL, **b, **copy = NULL, *s;
+  Mini_Cpgc_Heap *main_heap, *worker;
+  size_t hash;
+
+  heap_init(TINY_HEAP_SIZE);
+  main_heap = mini_cpgc_heap_current();
+  worker = mini_cpgc_heap_new(TINY_HEAP_SIZE);
+  assert(worker != NULL && mini_cpgc_heap_current() == main_heap);
+
+  mini_cpgc_add_root((void **)&a);
+  a = mini_cpgc_malloc_site(3 * PTRSIZE, 4);
+  b = mini_cpgc_malloc(2 * PTRSIZE);
+  s = mini_cpgc_string("message", 8);
+  a[0] = b;
+  a[1] = s;
+  a[2] = (void *)42;
+  b[0] = a;
+  b[1] = (char *)s + 1;
+  hash = mini_cpgc_identity_hash(b);
+
+  copy = mini_cpgc_transfer(main_heap, worker, a);
+  assert(copy != NULL && mini_cpgc_heap_current() == main_heap);
+  assert(!IN_HEAP(from_start, copy));
+  assert(!FL_TEST((Block_Header *)a - 1, FL_COPIED));
+  assert(((Block_Header *)a - 1)->next_free == NULL);
+  assert(a[0] == (void *)b && b[0] == (void *)a && a[1] == s);
+
+  /* the worker owns an independent copy */
+  mini_cpgc_heap_switch(worker);
+  mini_cpgc_add_root((void **)&copy);
+  assert(IN_HEAP(from_start, copy) && copy[2] == (void *)42);
+  assert(FL_SITE((Block_Header *)copy - 1) == 4);
+  copying();
+  b = copy[0];
+  assert(b[0] == (void *)copy && (char *)b[1] == (char *)copy[1] + 1);
+  assert(strcmp(copy[1], "message") == 0);
+  assert(mini_cpgc_identity_hash(b) == hash);
+  mini_cpgc_remove_root((void **)&copy);
+
+  mini_cpgc_heap_switch(main_heap);
+  copying();
+  assert(((void **)a[0])[0] == (void *)a && strcmp(a[1], "message") == 0);
+
+  /* frozen objects are copied without writing to them */
+  a = mini_cpgc_malloc(2 * PTRSIZE);
+  a[0] = mini_cpgc_string("frozen", 7);
+  a = mini_cpgc_freeze(a);
+  assert(is_frozen(a) && is_frozen(a[0]));
+  b = mini_cpgc_malloc(2 * PTRSIZE);
+  b[0] = a;
+  b[1] = a;
+  copy = mini_cpgc_transfer(main_heap, worker, b);
+  assert(copy != NULL && copy[0] == copy[1] && copy[0] != (void *)a);
+  assert(!FL_TEST((Block_Header *)a - 1, FL_COPIED));
+  mini_cpgc_heap_switch(worker);
+  mini_cpgc_add_root((void **)&copy);
+  copying();
+  assert(IN_HEAP(from_start, copy[0]) && copy[0] == copy[1]);
+  assert(strcmp(((void **)copy[0])[0], "frozen") == 0);
+  mini_cpgc_remove_root((void **)&copy);
+  mini_cpgc_heap_switch(main_heap);
+  mini_cpgc_heap_delete(worker);
+  mini_cpgc_remove_root((void **)&a);
+}
+
+static void test_concurrent_mark(void) {
+  void **live = NULL, **dead, **old_live, **old_dead, *fresh;
+  Mini_Cpgc_Heap *worker, *prev;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&live);
+  live = mini_cpgc_malloc(2 * PTRSIZE);
+  dead = mini_cpgc_malloc(2 * PTRSIZE);
+  old_live = old_malloc(PTRSIZE, FL_ALLOC);
+  old_dead = old_malloc(PTRSIZE, FL_ALLOC);
+  live[0] = old_live;
+  old_live[0] = mini_cpgc_malloc(PTRSIZE);
+  dead[0] = live;
+  old_dead[0] = dead;
+
+  assert(mini_cpgc_concurrent_mark_start());
+  assert(!mini_cpgc_concurrent_mark_start());
+  /* unreachable, but allocated after the snapshot */
+  fresh = mini_cpgc_malloc(2 * PTRSIZE);
+  assert(mini_cpgc_concurrent_mark_finish(1) == 2);
+  assert(!FL_TEST((Block_Header *)dead - 1, FL_ALLOC));
+  assert(!FL_TEST((Block_Header *)old_dead - 1, FL_ALLOC));
+  assert(FL_TEST((Block_Header *)fresh - 1, FL_ALLOC));
+  assert(FL_TEST((Block_Header *)old_live[0] - 1, FL_ALLOC));
+  assert(live[0] == old_live);
+  assert(old_malloc(PTRSIZE, FL_ALLOC) == old_dead);
+  assert(mini_cpgc_malloc(2 * PTRSIZE) == dead);
+
+  /* a collection moves the objects, the mark is discarded */
+  assert(mini_cpgc_concurrent_mark_start());
+  copying();
+  assert(mini_cpgc_concurrent_mark_finish(1) == 0);
+  assert(mini_cpgc_concurrent_mark_finish(1) == -1);
+
+  /* releasing the spaces discards the mark */
+  assert(mini_cpgc_concurrent_mark_start());
+  heap_init(TINY_HEAP_SIZE);
+  live = mini_cpgc_malloc(2 * PTRSIZE);
+  assert(mini_cpgc_concurrent_mark_finish(1) == -1);
+  assert(FL_TEST((Block_Header *)live - 1, FL_ALLOC));
+  worker = mini_cpgc_heap_new(TINY_HEAP_SIZE);
+  prev = mini_cpgc_heap_switch(worker);
+  assert(mini_cpgc_concurrent_mark_start());
+  mini_cpgc_heap_switch(prev);
+  mini_cpgc_heap_delete(worker);
+  assert(mini_cpgc_concurrent_mark_finish(1) == -1);
+  mini_cpgc_remove_root((void **)&live);
+}
+
+static void test_write_protect(void) {
+  void **old = NULL, **garbage, *young;
+  size_t page;
+
+  heap_init(TINY_HEAP_SIZE);
+  assert(mini_cpgc_set_write_protect(1));
+  mini_cpgc_add_root((void **)&old);
+  old = old_malloc(2 * PTRSIZE, FL_ALLOC);
+  copying();
+  page = ((size_t)old - (size_t)old_start) / wp_page_size;
+  assert(old_start->dirty != NULL);
+  assert(!((old_start->dirty[page / WORD_BITS] >> (page % WORD_BITS)) & 1));
+
+  /* the first write faults and dirties the page */
+  young = mini_cpgc_malloc(PTRSIZE);
+  *(size_t *)young = 42;
+  old[0] = young;
+  garbage = old_malloc(PTRSIZE, FL_ALLOC);
+  assert((old_start->dirty[page / WORD_BITS] >> (page % WORD_BITS)) & 1);
+  mini_cpgc_minor_collect();
+  assert(old[0] != young && IN_HEAP(from_start, old[0]));
+  assert(*(size_t *)old[0] == 42);
+  assert(FL_TEST((Block_Header *)garbage - 1, FL_ALLOC));
+  /* the page still points to From-space, so it stays writable */
+  assert((old_start->dirty[page / WORD_BITS] >> (page % WORD_BITS)) & 1);
+  old[0] = NULL;
+  mini_cpgc_minor_collect();
+  assert(!((old_start->dirty[page / WORD_BITS] >> (page % WORD_BITS)) & 1));
+
+  copying();
+  assert(!FL_TEST((Block_Header *)garbage - 1, FL_ALLOC));
+  assert(mini_cpgc_set_write_protect(0));
+  assert(old_start->dirty == NULL);
+  old[1] = old;
+  mini_cpgc_remove_root((void **)&old);
+}
+
+static void test_lazy_compaction(void) {
+  void **list = NULL, **p, *head;
+  size_t hash, i;
+
+  heap_init(TINY_HEAP_SIZE);
+  mini_cpgc_add_root((void **)&list);
+  for (i = 0; i < 150; i++) {
+    p = mini_cpgc_malloc(2 * PTRSIZE);
+    p[0] = list;
+    p[1] = (void *)i;
+    list = p;
+    mini_cpgc_malloc(4 * PTRSIZE);
+  }
+  hash = mini_cpgc_identity_hash(list);
+  head = list;
+
+  mini_cpgc_compact();
+  assert(list != head && compact_pages >= 2);
+  assert(compact_left == compact_pages);
+  assert(mini_cpgc_compact_step(1) == compact_pages - 1);
+  /* the first access populates the page of the head */
+  assert(list[1] == (void *)149);
+  assert(compact_left < compact_pages - 1);
+  assert(mini_cpgc_identity_hash(list) == hash);
+  for (p = list, i = 150; p != NULL; p = p[0])
+    assert(p[1] == (void *)--i);
+  assert(i == 0);
+  assert(mini_cpgc_compact_step(SIZE_MAX) == 0 && compact_pages == 0);
+  assert(HEAP_USED(from_start) == 150 * (BLOCK_HEADER_SIZE + 2 * PTRSIZE) +
+                                      PTRSIZE);
+
+  copying();
+  assert(mini_cpgc_identity_hash(list) == hash);
+  for (p = list, i = 150; p != NULL; p = p[0])
+    assert(p[1] == (void *)--i);
+  mini_cpgc_remove_root((void **)&list);
+}
+
+static void test_mark_stack_overflow(void) {
+  void **table = NULL, **entry;
+  size_t i, n = MARK_STACK_SIZE + 100;
+
+  heap_init(0x80000);
+  mini_cpgc_add_root((void **)&table);
+  table = old_malloc(n * PTRSIZE, FL_ALLOC);
+  for (i = 0; i < n; i++) {
+    entry = old_malloc(2 * PTRSIZE, FL_ALLOC);
+    entry[0] = mini_cpgc_malloc(PTRSIZE);
+    entry[1] = (void *)i;
+    *(size_t *)entry[0] = i;
+    table[i] = entry;
+  }
+
+  /* the table marks more blocks than the stack holds */
+  copying();
+  assert(mark_len == 0 && !mark_overflow);
+  for (i = 0; i < n; i++) {
+    entry = table[i];
+    assert(FL_TEST((Block_Header *)entry - 1, FL_ALLOC));
+    assert(!FL_TEST((Block_Header *)entry - 1, FL_MARK));
+    assert(IN_HEAP(from_start, entry[0]) && *(size_t *)entry[0] == i);
+  }
+
+  mini_cpgc_compact();
+  assert(mark_len == 0 && !mark_overflow);
+  for (i = 0; i < n; i++)
+    assert(*(size_t *)((void **)table[i])[0] == i);
+
+  /* a rescan does not queue a scanned ephemeron again */
+  entry = old_malloc(2 * PTRSIZE, FL_ALLOC | FL_EPHEMERON);
+  entry[0] = table;
+  ((Block_Header *)entry - 1)->flags |= FL_MARK;
+  mark_rescan(old_start, scan_marked);
+  mark_rescan(old_start, scan_marked);
+  assert(ephemerons_len == 1 && ephemerons[0] == (Block_Header *)entry - 1);
+  ephemeron_clear();
+  assert(!FL_TEST((Block_Header *)entry - 1, FL_QUEUED) && entry[0] == NULL);
+  ((Block_Header *)entry - 1)->flags &= ~(size_t)FL_MARK;
+  mini_cpgc_remove_root((void **)&table);
 }
 
 static void test(void) {
   heap_init(TINY_HEAP_SIZE);
   test_mini_cpgc_malloc_free();
+  test_copying_roots();
+  test_malloc_atomic();
+  test_soft_limit();
+  test_numa_placement();
+  test_age_histogram();
+  test_pretenuring();
+  test_ephemeron();
+  test_string_dedup();
+  test_identity_hash();
+  test_map();
+  test_map_moved_keys();
+  test_interior_pointer();
+  test_permanent();
+  test_freeze();
+  test_data_segment_roots();
+  test_type_histogram();
+  test_heap_snapshot();
+  test_leak_check();
+  test_free_coalescing();
+  test_free_best_fit();
+  test_buddy();
+  test_clone();
+  test_serialize();
+  test_transfer();
+  test_concurrent_mark();
+  test_write_protect();
+  test_lazy_compaction();
+  test_mark_stack_overflow();
 }
 
 int main(int argc, char **argv) {
@@ -0,0 +1,90 @@
+/**
+ * @file gc.h
+ * @brief Public interface of the Copying Garbage Collector.
+ * @author matac
+ * @date 2023/09/23
+ */
+
+#ifndef MINI_CPGC_GC_H
+#define MINI_CPGC_GC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define MINI_CPGC_AGE_MAX 15
+#define MINI_CPGC_MAX_SITES 1024
+#define MINI_CPGC_NO_SITE 0
+#define MINI_CPGC_SIZE_CLASSES 65
+#define MINI_CPGC_SNAPSHOT_MAGIC "MCPGCHS1"
+
+typedef struct mini_cpgc_map Mini_Cpgc_Map;
+typedef struct mini_cpgc_heap Mini_Cpgc_Heap;
+
+/**
+ * @struct Mini_Cpgc_Type_Stats
+ * @brief The number and total size, headers included, of some objects.
+ */
+typedef struct mini_cpgc_type_stats {
+  size_t count;
+  size_t bytes;
+} Mini_Cpgc_Type_Stats;
+
+void heap_init(size_t req_size);
+void *mini_cpgc_malloc(size_t req_size);
+void *mini_cpgc_malloc_site(size_t req_size, unsigned int site);
+void *mini_cpgc_malloc_atomic(size_t req_size);
+void *mini_cpgc_malloc_permanent(size_t req_size, int pointer_free);
+int mini_cpgc_buddy_init(size_t size);
+void *mini_cpgc_malloc_buddy(size_t req_size);
+void mini_cpgc_free(void *ptr);
+void copying(void);
+
+void mini_cpgc_add_root(void **root);
+void mini_cpgc_remove_root(void **root);
+void mini_cpgc_set_scan_data_segments(int enable);
+void *mini_cpgc_base(void *ptr);
+void *mini_cpgc_freeze(void *root);
+void *mini_cpgc_clone(void *root);
+size_t mini_cpgc_serialize(void *root, void *buf, size_t len);
+void *mini_cpgc_deserialize(const void *buf, size_t len);
+
+void *mini_cpgc_ephemeron(void *key, void *value);
+void *mini_cpgc_string(const void *bytes, size_t len);
+void mini_cpgc_set_dedup(int enable);
+size_t mini_cpgc_identity_hash(void *ptr);
+
+Mini_Cpgc_Map *mini_cpgc_map_new(void);
+void mini_cpgc_map_delete(Mini_Cpgc_Map *map);
+void *mini_cpgc_map_get(Mini_Cpgc_Map *map, void *key);
+int mini_cpgc_map_put(Mini_Cpgc_Map *map, void *key, void *value);
+int mini_cpgc_map_remove(Mini_Cpgc_Map *map, void *key);
+
+Mini_Cpgc_Heap *mini_cpgc_heap_new(size_t size);
+void mini_cpgc_heap_delete(Mini_Cpgc_Heap *heap);
+Mini_Cpgc_Heap *mini_cpgc_heap_current(void);
+Mini_Cpgc_Heap *mini_cpgc_heap_switch(Mini_Cpgc_Heap *heap);
+void *mini_cpgc_transfer(Mini_Cpgc_Heap *src, Mini_Cpgc_Heap *dst,
+                         void *root);
+
+void mini_cpgc_set_cgroup_dir(const char *dir);
+void mini_cpgc_set_soft_limit(size_t bytes);
+size_t mini_cpgc_soft_limit(void);
+
+const size_t *mini_cpgc_age_histogram(void);
+int mini_cpgc_site_pretenured(unsigned int site);
+void mini_cpgc_set_type_histogram(int enable);
+const Mini_Cpgc_Type_Stats *mini_cpgc_type_histogram(void);
+const Mini_Cpgc_Type_Stats *mini_cpgc_size_class_histogram(void);
+void mini_cpgc_dump_type_histogram(FILE *fp);
+int mini_cpgc_write_snapshot(FILE *fp);
+void mini_cpgc_set_leak_check(FILE *fp);
+const Mini_Cpgc_Type_Stats *mini_cpgc_leaked(void);
+const Mini_Cpgc_Type_Stats *mini_cpgc_freed_reachable(void);
+int mini_cpgc_concurrent_mark_start(void);
+long mini_cpgc_concurrent_mark_finish(int wait);
+int mini_cpgc_set_write_protect(int enable);
+void mini_cpgc_minor_collect(void);
+void mini_cpgc_compact(void);
+size_t mini_cpgc_compact_step(size_t pages);
+
+#endif /* MINI_CPGC_GC_H */
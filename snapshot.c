@@ -0,0 +1,427 @@
+/**
+ * @file snapshot.c
+ * @brief Offline analyzer for the heap snapshots of mini_cpgc.
+ *
+ * Reads a snapshot written by mini_cpgc_write_snapshot, computes the
+ * dominator tree of the object graph with the Lengauer-Tarjan algorithm, and
+ * prints the objects retaining the most memory.
+ */
+
+#include "gc.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE UINT32_MAX
+#define DEFAULT_TOP 20
+
+/**
+ * @struct Graph
+ * @brief An object graph, with both edge directions in compressed rows.
+ *
+ * @var Graph::succ
+ * The successors of node v are succ[succ_off[v]] to succ[succ_off[v + 1] - 1].
+ *
+ * @var Graph::pred
+ * The predecessors, laid out like the successors.
+ */
+typedef struct graph {
+  uint32_t len;
+  uint64_t *address;
+  uint64_t *size;
+  uint32_t *type;
+  uint32_t *succ_off;
+  uint32_t *succ;
+  uint32_t *pred_off;
+  uint32_t *pred;
+} Graph;
+
+/**
+ * @struct Dominators
+ * @brief The state of the Lengauer-Tarjan algorithm and its results.
+ *
+ * @var Dominators::dfnum
+ * The depth-first preorder number of each node, NONE if unreachable.
+ *
+ * @var Dominators::vertex
+ * The node of each preorder number, reachable nodes first.
+ *
+ * @var Dominators::idom
+ * The immediate dominator of each node, NONE for the root and the
+ * unreachable nodes.
+ *
+ * @var Dominators::retained
+ * The bytes kept alive by each node: its own and those of every node it
+ * dominates.
+ */
+typedef struct dominators {
+  uint32_t reached;
+  uint32_t *dfnum;
+  uint32_t *vertex;
+  uint32_t *parent;
+  uint32_t *semi;
+  uint32_t *ancestor;
+  uint32_t *best;
+  uint32_t *samedom;
+  uint32_t *bucket;
+  uint32_t *bucket_next;
+  uint32_t *idom;
+  uint64_t *retained;
+} Dominators;
+
+/**
+ * @brief Allocates memory or exits.
+ *
+ * @param n The number of elements.
+ * @param size The size of an element.
+ * @return The zeroed memory.
+ */
+static void *xcalloc(size_t n, size_t size) {
+  void *p;
+
+  p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  return p;
+}
+
+/**
+ * @brief Reads exactly one value from the snapshot or exits.
+ */
+static void read_value(FILE *fp, void *value, size_t size) {
+  if (fread(value, size, 1, fp) != 1) {
+    fprintf(stderr, "snapshot: truncated snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * @brief Reads a snapshot into a graph.
+ *
+ * @param fp The snapshot stream.
+ * @param g The graph to fill.
+ */
+static void read_graph(FILE *fp, Graph *g) {
+  char magic[8];
+  uint64_t count;
+  uint32_t v, i, degree, *fill;
+  size_t cap = 1024, len = 0;
+
+  read_value(fp, magic, sizeof(magic));
+  if (memcmp(magic, MINI_CPGC_SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "snapshot: not a mini_cpgc heap snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+  read_value(fp, &count, sizeof(count));
+  if (count == 0 || count >= NONE) {
+    fprintf(stderr, "snapshot: bad node count %llu\n",
+            (unsigned long long)count);
+    exit(EXIT_FAILURE);
+  }
+
+  g->len = (uint32_t)count;
+  g->address = xcalloc(g->len, sizeof(*g->address));
+  g->size = xcalloc(g->len, sizeof(*g->size));
+  g->type = xcalloc(g->len, sizeof(*g->type));
+  g->succ_off = xcalloc(g->len + 1, sizeof(*g->succ_off));
+  g->succ = xcalloc(cap, sizeof(*g->succ));
+  for (v = 0; v < g->len; v++) {
+    read_value(fp, &g->address[v], sizeof(*g->address));
+    read_value(fp, &g->size[v], sizeof(*g->size));
+    read_value(fp, &g->type[v], sizeof(*g->type));
+    read_value(fp, &degree, sizeof(degree));
+    while (len + degree > cap) {
+      cap *= 2;
+      g->succ = realloc(g->succ, cap * sizeof(*g->succ));
+      if (g->succ == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (i = 0; i < degree; i++) {
+      read_value(fp, &g->succ[len], sizeof(*g->succ));
+      if (g->succ[len] >= g->len) {
+        fprintf(stderr, "snapshot: bad edge %u -> %u\n", v, g->succ[len]);
+        exit(EXIT_FAILURE);
+      }
+      len++;
+    }
+    g->succ_off[v + 1] = (uint32_t)len;
+  }
+
+  /* count, then place, the reversed edges */
+  g->pred_off = xcalloc(g->len + 1, sizeof(*g->pred_off));
+  g->pred = xcalloc(len, sizeof(*g->pred));
+  for (i = 0; i < len; i++)
+    g->pred_off[g->succ[i] + 1]++;
+  for (v = 0; v < g->len; v++)
+    g->pred_off[v + 1] += g->pred_off[v];
+  fill = xcalloc(g->len, sizeof(*fill));
+  memcpy(fill, g->pred_off, g->len * sizeof(*fill));
+  for (v = 0; v < g->len; v++)
+    for (i = g->succ_off[v]; i < g->succ_off[v + 1]; i++)
+      g->pred[fill[g->succ[i]]++] = v;
+  free(fill);
+}
+
+/**
+ * @brief Numbers the nodes reachable from node 0 in depth-first preorder.
+ *
+ * The search keeps an explicit stack, so deep lists cannot overflow the C
+ * stack.
+ */
+static void number(const Graph *g, Dominators *d) {
+  uint32_t *stack, *cursor, depth, v, w;
+
+  stack = xcalloc(g->len, sizeof(*stack));
+  cursor = xcalloc(g->len, sizeof(*cursor));
+  d->dfnum[0] = 0;
+  d->vertex[0] = 0;
+  d->parent[0] = NONE;
+  d->reached = 1;
+  stack[0] = 0;
+  cursor[0] = g->succ_off[0];
+  depth = 1;
+  while (depth > 0) {
+    v = stack[depth - 1];
+    if (cursor[v] == g->succ_off[v + 1]) {
+      depth--;
+      continue;
+    }
+    w = g->succ[cursor[v]++];
+    if (d->dfnum[w] != NONE)
+      continue;
+    d->dfnum[w] = d->reached;
+    d->vertex[d->reached++] = w;
+    d->parent[w] = v;
+    cursor[w] = g->succ_off[w];
+    stack[depth++] = w;
+  }
+  free(stack);
+  free(cursor);
+}
+
+/**
+ * @brief Returns the node of lowest semidominator on the forest path to v.
+ *
+ * Compresses the path on the way, walking it with an explicit stack.
+ *
+ * @param d The dominator state.
+ * @param v A node already linked into the forest.
+ * @param stack Scratch space for one entry per node.
+ */
+static uint32_t eval(Dominators *d, uint32_t v, uint32_t *stack) {
+  uint32_t depth = 0, x, a;
+
+  for (x = v; d->ancestor[d->ancestor[x]] != NONE; x = d->ancestor[x])
+    stack[depth++] = x;
+  while (depth > 0) {
+    x = stack[--depth];
+    a = d->ancestor[x];
+    if (d->dfnum[d->semi[d->best[a]]] < d->dfnum[d->semi[d->best[x]]])
+      d->best[x] = d->best[a];
+    d->ancestor[x] = d->ancestor[a];
+  }
+
+  return d->best[v];
+}
+
+/**
+ * @brief Computes the immediate dominators and the retained sizes.
+ *
+ * This is the simple version of Lengauer-Tarjan, with path compression but
+ * without balanced linking, which runs in O(E log V).
+ */
+static void dominate(const Graph *g, Dominators *d) {
+  uint32_t i, j, n, p, s, t, v, y, *stack;
+
+  d->dfnum = xcalloc(g->len, sizeof(*d->dfnum));
+  d->vertex = xcalloc(g->len, sizeof(*d->vertex));
+  d->parent = xcalloc(g->len, sizeof(*d->parent));
+  d->semi = xcalloc(g->len, sizeof(*d->semi));
+  d->ancestor = xcalloc(g->len, sizeof(*d->ancestor));
+  d->best = xcalloc(g->len, sizeof(*d->best));
+  d->samedom = xcalloc(g->len, sizeof(*d->samedom));
+  d->bucket = xcalloc(g->len, sizeof(*d->bucket));
+  d->bucket_next = xcalloc(g->len, sizeof(*d->bucket_next));
+  d->idom = xcalloc(g->len, sizeof(*d->idom));
+  d->retained = xcalloc(g->len, sizeof(*d->retained));
+  stack = xcalloc(g->len, sizeof(*stack));
+  for (v = 0; v < g->len; v++) {
+    d->dfnum[v] = NONE;
+    d->ancestor[v] = NONE;
+    d->samedom[v] = NONE;
+    d->bucket[v] = NONE;
+    d->idom[v] = NONE;
+    d->best[v] = v;
+    d->semi[v] = v;
+  }
+
+  number(g, d);
+  for (i = d->reached - 1; i > 0; i--) {
+    n = d->vertex[i];
+    p = d->parent[n];
+    s = p;
+    for (j = g->pred_off[n]; j < g->pred_off[n + 1]; j++) {
+      v = g->pred[j];
+      if (d->dfnum[v] == NONE)
+        continue;
+      t = d->dfnum[v] <= d->dfnum[n] ? v : d->semi[eval(d, v, stack)];
+      if (d->dfnum[t] < d->dfnum[s])
+        s = t;
+    }
+    d->semi[n] = s;
+    d->bucket_next[n] = d->bucket[s];
+    d->bucket[s] = n;
+    d->ancestor[n] = p;
+
+    for (v = d->bucket[p]; v != NONE; v = d->bucket_next[v]) {
+      y = eval(d, v, stack);
+      if (d->semi[y] == d->semi[v])
+        d->idom[v] = p;
+      else
+        d->samedom[v] = y;
+    }
+    d->bucket[p] = NONE;
+  }
+  for (i = 1; i < d->reached; i++) {
+    n = d->vertex[i];
+    if (d->samedom[n] != NONE)
+      d->idom[n] = d->idom[d->samedom[n]];
+  }
+
+  for (i = 0; i < d->reached; i++)
+    d->retained[d->vertex[i]] = g->size[d->vertex[i]];
+  for (i = d->reached - 1; i > 0; i--)
+    d->retained[d->idom[d->vertex[i]]] += d->retained[d->vertex[i]];
+  free(stack);
+}
+
+static const Dominators *sort_by;
+
+/**
+ * @brief qsort comparator putting the biggest retainers first.
+ */
+static int retained_cmp(const void *a, const void *b) {
+  uint64_t x = sort_by->retained[*(const uint32_t *)a];
+  uint64_t y = sort_by->retained[*(const uint32_t *)b];
+
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * @brief Prints the totals and the objects retaining the most memory.
+ *
+ * @param g The graph.
+ * @param d Its dominators.
+ * @param top The number of objects to print.
+ */
+static void report(const Graph *g, const Dominators *d, uint32_t top) {
+  uint32_t i, v, *order;
+
+  printf("%u objects, %u reachable, %llu bytes live\n\n", g->len - 1,
+         d->reached - 1, (unsigned long long)d->retained[0]);
+
+  order = xcalloc(d->reached, sizeof(*order));
+  memcpy(order, d->vertex, d->reached * sizeof(*order));
+  sort_by = d;
+  qsort(order + 1, d->reached - 1, sizeof(*order), retained_cmp);
+  printf("%-18s %6s %10s %12s  %s\n", "object", "site", "size", "retained",
+         "dominator");
+  for (i = 1; i < d->reached && i <= top; i++) {
+    v = order[i];
+    printf("0x%016llx %6u %10llu %12llu  ", (unsigned long long)g->address[v],
+           g->type[v], (unsigned long long)g->size[v],
+           (unsigned long long)d->retained[v]);
+    if (d->idom[v] == 0)
+      printf("(root)\n");
+    else
+      printf("0x%016llx\n", (unsigned long long)g->address[d->idom[v]]);
+  }
+  free(order);
+}
+
+/**
+ * @brief Checks the dominators of a small graph written as a snapshot.
+ *
+ * The root reaches 3 through both 1 and 2, so 3 is dominated by the root
+ * only; 4 and 5 form a cycle below 3, and 7 is unreachable.
+ */
+static void test(void) {
+  static const uint32_t degree[] = {2, 1, 1, 1, 2, 1, 0, 1};
+  static const uint32_t succ[][2] = {{1, 2}, {3}, {3}, {4},
+                                     {5, 6}, {4}, {0}, {6}};
+  static const uint32_t idom[] = {NONE, 0, 0, 0, 3, 4, 4, NONE};
+  static const uint64_t retained[] = {126, 2, 4, 120, 112, 32, 64, 0};
+  uint64_t count = 8, address, size;
+  uint32_t v, type = 0;
+  Graph g;
+  Dominators d;
+  FILE *fp;
+
+  fp = tmpfile();
+  assert(fp != NULL);
+  fwrite(MINI_CPGC_SNAPSHOT_MAGIC, 8, 1, fp);
+  fwrite(&count, sizeof(count), 1, fp);
+  for (v = 0; v < count; v++) {
+    address = 0x1000 + v * 0x100;
+    size = v == 0 ? 0 : (uint64_t)1 << v;
+    fwrite(&address, sizeof(address), 1, fp);
+    fwrite(&size, sizeof(size), 1, fp);
+    fwrite(&type, sizeof(type), 1, fp);
+    fwrite(&degree[v], sizeof(degree[v]), 1, fp);
+    fwrite(succ[v], sizeof(succ[v][0]), degree[v], fp);
+  }
+  rewind(fp);
+  read_graph(fp, &g);
+  fclose(fp);
+
+  dominate(&g, &d);
+  assert(g.len == count && d.reached == 7);
+  assert(g.pred_off[5] - g.pred_off[4] == 2);
+  for (v = 0; v < count; v++) {
+    assert(d.idom[v] == idom[v]);
+    assert(d.retained[v] == retained[v]);
+  }
+  assert(d.dfnum[7] == NONE);
+}
+
+int main(int argc, char **argv) {
+  Graph g;
+  Dominators d;
+  uint32_t top = DEFAULT_TOP;
+  FILE *fp;
+
+  if (argc == 2 && strcmp(argv[1], "test") == 0) {
+    test();
+    return 0;
+  }
+  if (argc == 4 && strcmp(argv[1], "-n") == 0) {
+    top = (uint32_t)strtoul(argv[2], NULL, 10);
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc != 2) {
+    fprintf(stderr, "usage: snapshot [-n count] file\n");
+    return EXIT_FAILURE;
+  }
+
+  fp = fopen(argv[1], "rb");
+  if (fp == NULL) {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  read_graph(fp, &g);
+  fclose(fp);
+
+  dominate(&g, &d);
+  report(&g, &d, top);
+
+  return 0;
+}